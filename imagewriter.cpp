@@ -51,6 +51,14 @@
  */
 
 #include "imagewriter.h"
+#include "iw_glyph_atlas.h"
+#include "iw_linecache.h"
+#include "iw_pagebuf.h"
+#include "iw_psencode.h"
+#ifdef HAVE_ZLIB
+#include "iw_png.h"
+#include "iw_pdf.h"
+#endif
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
@@ -58,6 +66,9 @@
 #if !defined(WIN32)
 #include <unistd.h>
 #endif
+#ifdef HAVE_SDL
+#include "SDL.h"
+#endif
 
 //#include "png.h"
 //#pragma comment( lib, "libpng.lib" )
@@ -69,12 +80,36 @@ static const char *s_printer_name = NULL;
 static int s_output_page_num = 0;
 
 static char s_output_prefix[80] = "";
+static bool s_mono_pages = true;				// Pages start packed to 1 bit while no color ink lands on them
+static bool s_black_only = false;			// The job prints black ink only (mono=on): continuous BMP at 1 bit
+static bool s_indexed_colorps = true;			// colorps pages as palette indices, else RGB
+static bool s_ps_level3 = false;			// PostScript 3 with Flate compressed image data
+static int s_deflate_level = 6;			// zlib compression level of Flate data and PNG files
+#ifdef HAVE_ZLIB
+static Bitu s_png_threads = 0;				// Bands of a PNG page compressed at once, 0 = a thread per processor
+static bool s_gray_pdf = false;				// PDF pages in gray instead of palette indices
+#endif
+static bool s_ps_binary = false;			// PostScript image data without ASCII85
+static bool s_continuous_feed = false;
+static int s_feed_reach = 72;				// Reverse feed reach on continuous feed (1/72 inch)
+static Bitu s_page_budget = 0;				// Memory for the strips of a page (MB), 0 = no limit
+static Bit64u s_peak_memory = 0;			// Peak page memory of the last printer closed (bytes)
+#ifdef HAVE_SDL
+static bool s_preview_pages = false;
+#endif
 static char s_text_output_path[256] = "";
+
+// zlib level for the PostScript image data, 0 = run-length encoded
+static int psDeflate()
+{
+	return s_ps_level3 ? s_deflate_level : 0;
+}
+
 static FILE *textPrinterFile = NULL;
 
 #define PARAM16(I) (params[I+1]*256+params[I])
 #define PIXX ((Bitu)floor(curX*dpi+0.5))
-#define PIXY ((Bitu)floor(curY*dpi+0.5))
+#define PIXY ((Bitu)(floor(curY*dpi+0.5) + sheetTop))
 //These ugly defines are so we can convert multibyte parameters from strings into some nice ints.
 #define paramc(I) (params[I]-'0')
 #define PARAM2(I) (paramc(I)*10+paramc(I+1))
@@ -101,8 +136,59 @@ extern "C" int iw_scc_write;
 #define SWITCHA_PERFORATIONSKIP 0x10
 #define SWITCHA_LFAFTERCR       0x80
 
-#ifdef HAVE_SDL
-void Imagewriter::FillPalette(Bit8u redmax, Bit8u greenmax, Bit8u bluemax, Bit8u colorID, SDL_Palette* pal)
+// Longest run of characters laid out and blitted in one go
+#define IW_RUN_MAX              256
+
+// Shortest line segment (in glyphs) worth looking up in the line cache
+#define IW_LINECACHE_MIN        4
+
+// Height of the band buffer in 1/72 inch: the 8 dot head pass plus the text that
+// hangs above and below it (ascenders, descenders, super- and subscripts)
+#define IW_BAND_DOTS            24
+
+// Rows per strip of the page store
+#define IW_TILE_ROWS            32
+
+// Strips always kept in memory, whatever the page budget
+#define IW_MIN_RESIDENT_TILES   4
+
+// Smallest bit image block (in columns) worth looking up in the graphics cache
+#define IW_BLOCKCACHE_MIN       8
+
+// Largest height of the page preview window in pixels
+#define IW_PREVIEW_HEIGHT       900
+
+// States of the ESC I custom character parser
+#define UDC_NONE                0x00
+#define UDC_CODE                0x01	// Expecting the character to define, or CTRL-D to end
+#define UDC_WIDTH               0x02	// Expecting the width code ('A' = 1 dot ... 'P' = 16 dots)
+#define UDC_DATA                0x03	// Reading the dot columns
+
+#ifdef HAVE_FREETYPE
+// Hit statistics of a raster cache through the status callback
+static void reportCache(const char* name, const char* what, const IWLineCache* cache)
+{
+	if (!s_status_callback || cache->hits + cache->misses == 0)
+		return;
+	char msg[96];
+	snprintf(msg, sizeof(msg), "%s: %lu hits, %lu misses (%lu%%), %lu %s stored", name,
+		(unsigned long)cache->hits, (unsigned long)cache->misses,
+		(unsigned long)(cache->hits*100/(cache->hits + cache->misses)),
+		(unsigned long)cache->stores, what);
+	s_status_callback(msg);
+}
+
+static void reportMemory(const IWPageBuffer* page)
+{
+	s_peak_memory = page->peak;
+	if (!s_status_callback)
+		return;
+	char msg[64];
+	snprintf(msg, sizeof(msg), "Page memory: %lu KB peak", (unsigned long)(page->peak >> 10));
+	s_status_callback(msg);
+}
+
+void Imagewriter::FillPalette(Bit8u redmax, Bit8u greenmax, Bit8u bluemax, Bit8u colorID, IWColor* pal)
 {
 	float red=redmax/30.9;
 	float green=greenmax/30.9;
@@ -111,28 +197,37 @@ void Imagewriter::FillPalette(Bit8u redmax, Bit8u greenmax, Bit8u bluemax, Bit8u
 	Bit8u colormask=colorID<<=5;
 
 	for(int i = 0; i < 32;i++) {
-		pal->colors[i+colormask].r=255-(red*(float)i);
-		pal->colors[i+colormask].g=255-(green*(float)i);
-		pal->colors[i+colormask].b=255-(blue*(float)i);
+		pal[i+colormask].r=255-(red*(float)i);
+		pal[i+colormask].g=255-(green*(float)i);
+		pal[i+colormask].b=255-(blue*(float)i);
 	}
 }
-#endif // HAVE_SDL
+#endif // HAVE_FREETYPE
 
 Imagewriter::Imagewriter(Bit16u dpi, Bit16u paperSize, Bit16u bannerSize, char* output, bool multipageOutput)
 {
-#ifdef HAVE_SDL
-	if (FT_Init_FreeType(&FTlib))
-	{
-		page = NULL;
-	}
-	else
-	{
-		SDL_Init(SDL_INIT_EVERYTHING);
+#ifdef HAVE_FREETYPE
+		// FreeType and the font are only brought up when the first glyph is printed,
+		// so pure graphics jobs never pay for them. The page is a plain memory buffer
+		// and needs no display library.
 		this->output = output;
 		this->multipageOutput = multipageOutput;
 		this->port = port;
+		if (!imagewriter_has_output(output))
+			printf("Printer: %s output needs a build with zlib, pages are saved as BMP\n", output);
+
+		// Continuous feed streams the paper out, which the printer, PNG and PDF outputs can't take
+		continuousFeed = s_continuous_feed && strcasecmp(output, "printer") != 0
+			&& strcasecmp(output, "png") != 0 && strcasecmp(output, "pdf") != 0
+			&& strcasecmp(output, "text") != 0;
 
-		if (bannerSize)
+		if (bannerSize && continuousFeed)
+		{
+			// The banner is as long as the paper runs, the page is a window of one sheet
+			defaultPageWidth = ((Real64)paperSizes[0][0]/(Real64)72);
+			defaultPageHeight = ((Real64)paperSizes[0][1]/(Real64)72);
+		}
+		else if (bannerSize)
 		{
 			defaultPageWidth = ((Real64)paperSizes[0][0]/(Real64)72);
 			defaultPageHeight = (((Real64)paperSizes[0][1]*bannerSize)/(Real64)72);
@@ -149,25 +244,85 @@ Imagewriter::Imagewriter(Bit16u dpi, Bit16u paperSize, Bit16u bannerSize, char*
 			defaultPageHeight = ((Real64)paperSizes[paperSize][1]/(Real64)72);
 		}
 		this->dpi = dpi;
-		// Create page
-		page = SDL_CreateRGBSurface(
-						SDL_SWSURFACE, 
-						(Bitu)(defaultPageWidth*dpi), 
-						(Bitu)(defaultPageHeight*dpi), 
-						8, 
-						0, 
-						0, 
-						0, 
-						0);
+		// Create page. The buffer carries the geometry and the palette, the pixels
+		// live in the strips below.
+		Bitu pageW = (Bitu)(defaultPageWidth*dpi);
+		page = new IWPageBuffer(pageW, (Bitu)(defaultPageHeight*dpi));
+
+		// Pixel offsets into the page are 32 bits wide
+		if ((Bit64u)page->h*page->pitch > 0xFFFFFFFFu)
+		{
+			page->h = 0xFFFFFFFFu / page->pitch;
+			printf("Printer: page cut to %u rows, use continuous feed for longer banners\n", page->h);
+		}
+		monoPage = false;
+		monoPitch = (pageW+7)/8;
+		rowScratch = page->allocRows(page->pitch);
+		rowScratchY = (Bitu)-1;
+		packScratch = page->allocRows(page->pitch);
+		whiteRow = page->allocRows(page->pitch);
+
+		// The page is kept in strips of rows that are only allocated once inked
+		numTiles = (page->h + IW_TILE_ROWS-1) / IW_TILE_ROWS;
+		tiles = (Bit8u**)calloc(numTiles, sizeof(Bit8u*));
+		colorTiles = (Bit8u**)calloc(numTiles, sizeof(Bit8u*));
+		numColorTiles = 0;
+		numResidentColors = 0;
+		tileBytes = 0;
+
+		// Over the memory budget strips spill to a temporary file
+		pageBudget = (Bit64u)s_page_budget << 20;
+		numResidentTiles = 0;
+		tileSpill = (Bit64s*)malloc(numTiles*sizeof(Bit64s));
+		colorSpill = (Bit64s*)malloc(numTiles*sizeof(Bit64s));
+		tileSaved = (bool*)malloc(numTiles*sizeof(bool));
+		for (Bitu i=0; i<numTiles; i++)
+		{
+			tileSpill[i] = -1;
+			colorSpill[i] = -1;
+			tileSaved[i] = false;
+		}
+		spillFile = NULL;
+		spillEnd = 0;
+		pinnedTile = numTiles;
+		page->setReclaim(reclaimTile, this);
+
+		// One head pass is composed at a time in a buffer that stays in the cache
+		bandCapacity = (IW_BAND_DOTS*dpi + 71)/72;
+		band = page->allocRows(bandCapacity*page->pitch);
+		bandTop = bandRows = 0;
+		bandDirtyTop = bandDirtyEnd = 0;
+		inkLeft = page->w;
+		inkTop = page->h;
+		inkRight = inkBottom = 0;
+		numInkedTiles = 0;
+
+		// On continuous feed the window keeps an inch below the head for what it prints and
+		// the reverse feed reach above it
+		windowTop = 0;
+		sheetTop = 0;
+		feedAhead = dpi;
+		reachRows = (s_feed_reach*dpi)/72;
+		if (reachRows + feedAhead + IW_TILE_ROWS > (Bitu)page->h)
+			reachRows = (Bitu)page->h > feedAhead + IW_TILE_ROWS ? page->h - feedAhead - IW_TILE_ROWS : 0;
+		feedInkEnd = 0;
+		feedFile = NULL;
+		feedBits = 8;
+		feedPages = 0;
+		feedLine = NULL;
+		feedSheetTop = 0;
+		feedSheetRows = 0;
+		feedCuts = NULL;
+		numFeedCuts = maxFeedCuts = 0;
 
 		// Set a grey palette
-		SDL_Palette* palette = page->format->palette;
+		IWColor* palette = page->palette;
 		
 		for (Bitu i=0; i<32; i++)
 		{
-			palette->colors[i].r =255;
-			palette->colors[i].g =255;
-			palette->colors[i].b =255;
+			palette[i].r =255;
+			palette[i].g =255;
+			palette[i].b =255;
 		}
 		
 		// 0 = all white needed for logic 000
@@ -211,8 +366,23 @@ Imagewriter::Imagewriter(Bit16u dpi, Bit16u paperSize, Bit16u bannerSize, char*
 		// then yellow on magenta 001 | 100 = 101 = red
 		
 		color=COLOR_BLACK;
+		clearPage();
 		
+		ftInitialized = false;
 		curFont = NULL;
+		fontFace = NULL;
+		fontHorizPoints = fontVertPoints = 0;
+		fontItalic = false;
+		fontAscender = fontHeight = 0;
+		curAtlas = NULL;
+		udcStamps = NULL;
+		runScratch = NULL;
+		lineCache = new IWLineCache();
+		blockCache = new IWLineCache();
+		blockKey = NULL;
+		blockKeySize = 0;
+		scaleX.density = scaleY.density = 0;
+		runScratchSize = 0;
 		charRead = false;
 		autoFeed = false;
 		outputHandle = NULL;
@@ -255,25 +425,24 @@ Imagewriter::Imagewriter(Bit16u dpi, Bit16u paperSize, Bit16u bannerSize, char*
 			ShowCursor(0);
 #endif // WIN32
 		}
-	}
-#endif // HAVE_SDL
-#ifndef HAVE_SDL
+#endif // HAVE_FREETYPE
+#ifndef HAVE_FREETYPE
 		this->output = output;
 		this->multipageOutput = multipageOutput;
-#endif // !HAVE_SDL
+#endif // !HAVE_FREETYPE
 };
 
 void Imagewriter::resetPrinterHard()
 {
-#ifdef HAVE_SDL
+#ifdef HAVE_FREETYPE
 	charRead = false;
 	resetPrinter();
-#endif // HAVE_SDL
+#endif // HAVE_FREETYPE
 }
 
 void Imagewriter::resetPrinter()
 {
-#ifdef HAVE_SDL
+#ifdef HAVE_FREETYPE
 		printRes = 0;	
 		color=COLOR_BLACK;
 		curX = curY = 0.0;
@@ -295,6 +464,7 @@ void Imagewriter::resetPrinter()
 		extraIntraSpace = 0.0;
 		printUpperContr = true;
 		bitGraph.remBytes = 0;
+		bitGraph.kernel = NULL;
 		densk = 0;
 		densl = 1;
 		densy = 2;
@@ -310,14 +480,18 @@ void Imagewriter::resetPrinter()
 		numPrintAsChar = 0;
 		LQtypeFace = fixed;
 		verticalDot = 0;
+		udcSelected = false;
+		udcState = UDC_NONE;
+		udcStampDpi = 0;
+		memset(udc, 0, sizeof(udc));
 		selectCodepage(charTables[curCharTable]);
 
 		updateFont();
 		updateSwitch();
 
-#endif // HAVE_SDL
+#endif // HAVE_FREETYPE
 		newPage(false,true);
-#ifdef HAVE_SDL
+#ifdef HAVE_FREETYPE
 
 		// Default tabs => Each eight characters
 		/*for (Bitu i=0;i<32;i++)
@@ -325,27 +499,59 @@ void Imagewriter::resetPrinter()
 		numHorizTabs = 0;
 
 		numVertTabs = 0;
-#endif // HAVE_SDL
+#endif // HAVE_FREETYPE
 }
 
 
 Imagewriter::~Imagewriter(void)
 {
-#ifdef HAVE_SDL
+#ifdef HAVE_FREETYPE
+	if (feedFile != NULL)
+		finishFeed();
 	finishMultipage();
-	if (page != NULL)
-	{
-		SDL_FreeSurface(page);
-		page = NULL;
+	free(udcStamps);
+	free(runScratch);
+	reportCache("Line cache", "lines", lineCache);
+	reportCache("Graphics cache", "blocks", blockCache);
+	delete lineCache;
+	delete blockCache;
+	free(blockKey);
+	if (curFont != NULL)
+		FT_Done_Face(curFont);
+	if (ftInitialized)
 		FT_Done_FreeType(FTlib);
+	page->setReclaim(NULL, NULL);
+	page->freeRows(band);
+	for (Bitu i=0; i<numTiles; i++)
+	{
+		page->freeRows(tiles[i]);
+		page->freeRows(colorTiles[i]);
 	}
+	free(tiles);
+	free(colorTiles);
+	free(tileSpill);
+	free(colorSpill);
+	free(tileSaved);
+	if (spillFile != NULL)
+		fclose(spillFile);
+	page->freeRows(rowScratch);
+	page->freeRows(packScratch);
+	page->freeRows(whiteRow);
+	free(feedCuts);
+	reportMemory(page);
+	delete page;
+	page = NULL;
+#ifdef HAVE_SDL
+	if (SDL_WasInit(SDL_INIT_VIDEO))
+		SDL_QuitSubSystem(SDL_INIT_VIDEO);
+#endif
 #if defined (WIN32)
 	DeleteDC(printerDC);
 #endif
-#endif // HAVE_SDL
+#endif // HAVE_FREETYPE
 };
 
-#ifdef HAVE_SDL
+#ifdef HAVE_FREETYPE
 void Imagewriter::selectCodepage(Bit16u cp)
 {
 	Bit16u *mapToUse = NULL;
@@ -366,79 +572,135 @@ void Imagewriter::selectCodepage(Bit16u cp)
 	for (int i=0; i<256; i++)
 		curMap[i] = mapToUse[i];
 }
-#endif // HAVE_SDL
+#endif // HAVE_FREETYPE
 
-#ifdef HAVE_SDL
-void Imagewriter::updateFont()
+#ifdef HAVE_FREETYPE
+// Finds the embedded atlas size rendered from the given font file, if any
+static const IWAtlasSize* findAtlasSize(const char* fontName, Bit16u dpi, Bit16u horizPoints, Bit16u vertPoints)
 {
-	//	char buffer[1000];
-	if (curFont != NULL)
-		FT_Done_Face(curFont);
+	const char* base = fontName;
+	for (const char* p = fontName; *p; p++)
+		if (*p == '/' || *p == '\\') base = p + 1;
+	if (strcasecmp(base, iwAtlasFontName) != 0)
+		return NULL;
+
+	for (Bitu i=0; i<iwAtlasNumSizes; i++)
+		if (iwAtlasSizes[i].dpi == dpi && iwAtlasSizes[i].horizPoints == horizPoints && iwAtlasSizes[i].vertPoints == vertPoints)
+			return &iwAtlasSizes[i];
+	return NULL;
+}
 
-	char* fontName;
+static const IWAtlasGlyph* findAtlasGlyph(const IWAtlasSize* size, Bit16u code)
+{
+	Bitu lo = 0, hi = size->numGlyphs;
+	while (lo < hi)
+	{
+		Bitu mid = (lo + hi) / 2;
+		if (size->glyphs[mid].code < code) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo < size->numGlyphs && size->glyphs[lo].code == code)
+		return &size->glyphs[lo];
+	return NULL;
+}
 
+const char* Imagewriter::fontFileName()
+{
 	switch (LQtypeFace)
 	{
 	case fixed:
-		fontName = g_imagewriter_fixed_font;
-		break;
+		return g_imagewriter_fixed_font;
 	case prop:
-		fontName = g_imagewriter_prop_font;
-		break;
+		return g_imagewriter_prop_font;
 	default:
-		fontName = g_imagewriter_fixed_font;
-	}
-	
-	if (FT_New_Face(FTlib, fontName, 0, &curFont))
-	{
-		
-		printf("Unable to load font %s\n");
-		//LOG_MSG("Unable to load font %s", fontName);
-		curFont = NULL;
+		return g_imagewriter_fixed_font;
 	}
+}
 
+void Imagewriter::updateFont()
+{
+	//	char buffer[1000];
 	Real64 horizPoints = 10;
 	Real64 vertPoints = 10;
 	if (!multipoint)
 	{
-		actcpi = cpi;
+		iw_font_points(style, cpi, &actcpi, &horizPoints, &vertPoints);
+	} else { // multipoint true
+		actcpi = multicpi;
+		horizPoints = vertPoints = multiPointSize;
+		if (style & STYLE_SUPERSCRIPT || style & STYLE_SUBSCRIPT || style & STYLE_HALFHEIGHT)
+			vertPoints *= 2.0/3.0;
+	}
 
-		if (!(style & STYLE_CONDENSED)) {
-			horizPoints *= 10.0/cpi;
-			//vertPoints *= 10.0/cpi;
+	Bit16u newHorizPoints = (Bit16u)horizPoints;
+	Bit16u newVertPoints = (Bit16u)vertPoints;
+	bool newItalic = (style & STYLE_ITALICS || charTables[curCharTable] == 0);
+
+	// Most style changes (bold, underline, proportional...) keep the face. It is only
+	// dropped when the size, slant or typeface changes, and reloaded when a glyph needs it.
+	if (newHorizPoints != fontHorizPoints || newVertPoints != fontVertPoints ||
+		newItalic != fontItalic || fontFileName() != fontFace)
+	{
+		if (curFont != NULL)
+		{
+			FT_Done_Face(curFont);
+			curFont = NULL;
 		}
+		fontFailed = false;
+	}
 
-		if (!(style & STYLE_PROP)) {
-			if ((cpi == 10.0) && (style & STYLE_CONDENSED)) {
-				actcpi = 17.14;
-				horizPoints *= 10.0/17.14;
-			}
-			if ((cpi == 12.0) && (style & STYLE_CONDENSED)) {
-				actcpi = 20.0;
-				horizPoints *= 10.0/20.0;
-				vertPoints *= 10.0/12.0;
-			}	
-		} else if (style & STYLE_CONDENSED) horizPoints /= 2.0;
+	fontHorizPoints = newHorizPoints;
+	fontVertPoints = newVertPoints;
+	fontItalic = newItalic;
+
+	// The pre-rasterized atlas covers the bundled font at the common sizes.
+	// When it matches, the face is only loaded if a glyph is missing from it.
+	curAtlas = NULL;
+	if (!multipoint && !fontItalic)
+		curAtlas = findAtlasSize(fontFileName(), dpi, fontHorizPoints, fontVertPoints);
+
+	if (curAtlas)
+	{
+		fontAscender = curAtlas->ascender;
+		fontHeight = curAtlas->height;
+	}
+	else if (curFont)
+	{
+		fontAscender = curFont->size->metrics.ascender;
+		fontHeight = curFont->size->metrics.height;
+	}
+}
 
+bool Imagewriter::loadFace()
+{
+	if (fontFailed)
+		return false;
 
-		if ((style & STYLE_DOUBLEWIDTH)) {
-			actcpi /= 2.0;
-			horizPoints *= 2.0;
+	if (!ftInitialized)
+	{
+		if (FT_Init_FreeType(&FTlib))
+		{
+			printf("Unable to initialize FreeType\n");
+			fontFailed = true;
+			return false;
 		}
-	} else { // multipoint true
-		actcpi = multicpi;
-		horizPoints = vertPoints = multiPointSize;
+		ftInitialized = true;
 	}
 
-	if (style & STYLE_SUPERSCRIPT || style & STYLE_SUBSCRIPT || style & STYLE_HALFHEIGHT) {
-		//horizPoints *= 2.0/3.0;
-		vertPoints *= 2.0/3.0;
-		//actcpi /= 2.0/3.0;
+	const char* fontName = fontFileName();
+	fontFace = fontName;
+	if (FT_New_Face(FTlib, fontName, 0, &curFont))
+	{
+		printf("Unable to load font %s\n", fontName);
+		//LOG_MSG("Unable to load font %s", fontName);
+		curFont = NULL;
+		fontFailed = true;
+		return false;
 	}
 
-	FT_Set_Char_Size(curFont, (Bit16u)horizPoints*64, (Bit16u)vertPoints*64, dpi, dpi);
+	FT_Set_Char_Size(curFont, fontHorizPoints*64, fontVertPoints*64, dpi, dpi);
 	
-	if (style & STYLE_ITALICS || charTables[curCharTable] == 0)
+	if (fontItalic)
 	{
 		FT_Matrix  matrix;
 		matrix.xx = 0x10000L;
@@ -447,6 +709,51 @@ void Imagewriter::updateFont()
 		matrix.yy = 0x10000L;
 		FT_Set_Transform(curFont, &matrix, 0);
 	}
+
+	fontAscender = curFont->size->metrics.ascender;
+	fontHeight = curFont->size->metrics.height;
+	return true;
+}
+
+bool Imagewriter::getGlyph(Bit16u code, IWGlyph* glyph)
+{
+	if (curAtlas)
+	{
+		const IWAtlasGlyph* cached = findAtlasGlyph(curAtlas, code);
+		if (cached)
+		{
+			memset(&glyph->bitmap, 0, sizeof(glyph->bitmap));
+			glyph->bitmap.rows = cached->rows;
+			glyph->bitmap.width = cached->width;
+			glyph->bitmap.pitch = cached->width;
+			glyph->bitmap.buffer = (unsigned char*)curAtlas->pixels + cached->offset;
+			glyph->bitmap.num_grays = 256;
+			glyph->bitmap.pixel_mode = FT_PIXEL_MODE_GRAY;
+			glyph->left = cached->left;
+			glyph->top = cached->top;
+			glyph->advance = cached->advance;
+			return true;
+		}
+	}
+
+	// Do not print if no font is available
+	if (!curFont && !loadFace())
+		return false;
+
+	// Find the glyph for the char to render
+	FT_UInt index = FT_Get_Char_Index(curFont, code);
+	
+	// Load the glyph 
+	FT_Load_Glyph(curFont, index, FT_LOAD_DEFAULT);
+
+	// Render a high-quality bitmap
+	FT_Render_Glyph(curFont->glyph, FT_RENDER_MODE_NORMAL);
+
+	glyph->bitmap = curFont->glyph->bitmap;
+	glyph->left = curFont->glyph->bitmap_left;
+	glyph->top = curFont->glyph->bitmap_top;
+	glyph->advance = curFont->glyph->advance.x;
+	return true;
 }
 
 
@@ -483,23 +790,9 @@ void Imagewriter::updateSwitch()
 	}
 	else msb = 0;
 }
-void Imagewriter::slashzero(Bit16u penX, Bit16u penY)
-{
-		FT_Face slashFont = curFont;
-		FT_UInt slashindex = FT_Get_Char_Index(slashFont, curMap[0x2f]);
-		FT_Load_Glyph(slashFont, slashindex, FT_LOAD_DEFAULT);
-		FT_Render_Glyph(slashFont->glyph, FT_RENDER_MODE_NORMAL);
-		blitGlyph(slashFont->glyph->bitmap, penX, penY, false);
-		blitGlyph(slashFont->glyph->bitmap, penX+1, penY, true);
-		if (style & STYLE_BOLD) {
-			blitGlyph(slashFont->glyph->bitmap, penX+1, penY, true);
-			blitGlyph(slashFont->glyph->bitmap, penX+2, penY, true);
-			blitGlyph(slashFont->glyph->bitmap, penX+3, penY, true);
-		}
-}
-#endif // HAVE_SDL
+#endif // HAVE_FREETYPE
 
-#ifdef HAVE_SDL
+#ifdef HAVE_FREETYPE
 bool Imagewriter::processCommandChar(Bit8u ch)
 {
 	if (ESCSeen || FSSeen)
@@ -513,6 +806,7 @@ bool Imagewriter::processCommandChar(Bit8u ch)
 		case 0x21: // Select bold font											(ESC !) IW
 		case 0x22: // Cancel bold font											(ESC ") IW
 		case 0x24: // Cancel MSB control and Mousetext							(ESC $) IW
+		case 0x27: // Select user-defined set									(ESC ') IW
 		case 0x2b: // custom char width is 8 dots								(ESC -) IW
 		case 0x2e: // custom char width is 8 dots								(ESC +) IW
 		case 0x30: // Clear all tabs											(ESC 0) IW
@@ -528,6 +822,7 @@ bool Imagewriter::processCommandChar(Bit8u ch)
 		case 0x41: // Select 1/6-inch line spacing								(ESC A) IW
 		case 0x42: // Select 1/8-inch line spacing								(ESC B) IW
 		case 0x45: // 12 cpi, 96 dpi graphics									(ESC E) IW
+		case 0x49: // Define user-defined characters							(ESC I) IW
 		case 0x4d: // Same as ESC a2											(ESC M) IW
 		case 0x4e: // 10 cpi, 80 dpi graphics									(ESC N) IW
 		case 0x4f: // Disable paper-out detector								(ESC O) IW
@@ -592,10 +887,6 @@ bool Imagewriter::processCommandChar(Bit8u ch)
 			neededParam = 7;
 			msb = 255;
 			break;
-		case 0x27: // Select user-defined set									(ESC ')
-		case 0x49: // Define user-defined characters							(ESC I)
-			//LOG(LOG_MISC,LOG_ERROR)("User-defined characters not supported!");
-			return true;
 		default:
 			/*LOG_MSG("PRINTER: Unknown command %c (%02Xh) %c , unable to skip parameters.",
 				(ESCCmd & 0x800)?"FS":"ESC",ESCCmd, ESCCmd);*/
@@ -625,6 +916,16 @@ bool Imagewriter::processCommandChar(Bit8u ch)
 			if (params[0] == 'R')
 				newPage(true,false); // TODO resetx?
 			break;
+		case 0x24: // Cancel MSB control and Mousetext (ESC $) IW
+			udcSelected = false;
+			break;
+		case 0x27: // Select user-defined set (ESC ') IW
+			udcSelected = true;
+			break;
+		case 0x49: // Define user-defined characters (ESC I) IW
+			// Definitions follow as: char, width code, dot columns. CTRL-D ends the download
+			udcState = UDC_CODE;
+			break;
 		case 0x73: // Set intercharacter space (ESC s) IW
 			if (style & STYLE_PROP)
 			{
@@ -731,12 +1032,10 @@ bool Imagewriter::processCommandChar(Bit8u ch)
 				if (params[x] == ' ') params[x] = '0';
 				x++;
 			}
-			x = 0;
-			while ( x < PARAM4(0))
+			if (PARAM4(0) > 0)
 			{
-			setupBitImage(printRes, 1);
-			printBitGraph(params[4]);
-			x++;
+				setupBitImage(printRes, 0);
+				repeatBitColumn(&params[4], PARAM4(0));
 			}
 			msb = 0;
 			break;
@@ -751,14 +1050,10 @@ bool Imagewriter::processCommandChar(Bit8u ch)
 				if (params[x] == ' ') params[x] = '0';
 				x++;
 			}
-			x = 0;
-			while ( x < PARAM4(0))
+			if (PARAM4(0) > 0)
 			{
-			setupBitImage(printRes, 1);
-			printBitGraph(params[4]);
-			printBitGraph(params[5]);
-			printBitGraph(params[6]);
-			x++;
+				setupBitImage(printRes, 0);
+				repeatBitColumn(&params[4], PARAM4(0));
 			}
 			msb = 0;
 			break;
@@ -970,13 +1265,11 @@ bool Imagewriter::processCommandChar(Bit8u ch)
 				if (params[x] == ' ') params[x] = '0';
 				x++;
 			}
-			x = 0;
 			ESCCmd = 0;
-			while (x < PARAM3(0))
-			{			
-				printChar(params[3]);
-				x++;
-			}
+			Bit8u repeat[IW_RUN_MAX];
+			memset(repeat, params[3], sizeof(repeat));
+			for (x = PARAM3(0); x > 0; x -= IW_RUN_MAX)
+				printString(repeat, x < IW_RUN_MAX ? x : IW_RUN_MAX);
 			break;
 			}
 		case 0x30: //Clear all tabs
@@ -1221,7 +1514,7 @@ bool Imagewriter::processCommandChar(Bit8u ch)
 
 	return false;
 }
-#endif // HAVE_SDL
+#endif // HAVE_FREETYPE
 
 //static void PRINTER_EventHandler(Bitu param);
 
@@ -1230,25 +1523,57 @@ void Imagewriter::newPage(bool save, bool resetx)
 	//PIC_RemoveEvents(PRINTER_EventHandler);
 	if(printer_timout) timeout_dirty=false;
 	
-#ifdef HAVE_SDL
+#ifdef HAVE_FREETYPE
+	if (continuousFeed)
+	{
+		// Printed paper can't be taken back: the head moves on to the top of the next
+		// sheet, or of the current one when the printer is only reset. finishFeed()
+		// blanks the window at the end of the job
+		if (save)
+		{
+			sheetTop += (Bits)formRows();
+
+			// The feed stream cuts its sheet here, so that forms of a programmed length
+			// each get their own page
+			Bitu cut = windowTop + sheetTop;
+			if (numFeedCuts == maxFeedCuts)
+			{
+				Bitu size = maxFeedCuts > 0 ? maxFeedCuts*2 : 16;
+				Bitu* grown = (Bitu*)realloc(feedCuts, size*sizeof(Bitu));
+				if (grown != NULL)
+				{
+					feedCuts = grown;
+					maxFeedCuts = size;
+				}
+			}
+			if (numFeedCuts < maxFeedCuts && cut > (numFeedCuts > 0 ? feedCuts[numFeedCuts-1] : feedSheetTop))
+				feedCuts[numFeedCuts++] = cut;
+		}
+		if(resetx) curX=leftMargin;
+		curY = topMargin;
+		return;
+	}
+
 	if (save)
 		outputPage();
 
 	if(resetx) curX=leftMargin;
 	curY = topMargin;
+	sheetTop = 0;
 
-	SDL_Rect rect;
-	rect.x = 0;
-	rect.y = 0;
-	rect.w = page->w;
-	rect.h = page->h;
-	SDL_FillRect(page, &rect, SDL_MapRGB(page->format, 255, 255, 255));
+	// Whatever was composed for the old page is dropped with it
+	bandRows = 0;
+	bandDirtyTop = bandDirtyEnd = 0;
+	inkLeft = page->w;
+	inkTop = page->h;
+	inkRight = inkBottom = 0;
+	clearPage();
 
 	/*for(int i = 0; i < 256; i++)
 	{
         *((Bit8u*)page->pixels+i)=i;
 	}*/
-#endif // HAVE_SDL
+#endif // HAVE_FREETYPE
 	if (strcasecmp(output, "text") == 0) { /* Text file */
 		if (textPrinterFile) {
 			fclose(textPrinterFile);
@@ -1259,15 +1584,15 @@ void Imagewriter::newPage(bool save, bool resetx)
 
 void Imagewriter::printChar(Bit8u ch)
 {
-#ifdef HAVE_SDL
+#ifdef HAVE_FREETYPE
 
 	charRead = true;
 	if (page == NULL) return;
 // Apply MSB if desired, but only if we aren't printing graphics!
 	if (msb != 255) {
-		if (!bitGraph.remBytes) ch &= 0x7F;
+		if (!bitGraph.remBytes && !udcState) ch &= 0x7F;
 	}
-#endif // HAVE_SDL
+#endif // HAVE_FREETYPE
 	if (strcasecmp(output, "text") == 0) {
 		if (!textPrinterFile) {
 			if (s_output_prefix[0]) {
@@ -1289,141 +1614,986 @@ void Imagewriter::printChar(Bit8u ch)
 		fflush(textPrinterFile);
 		return;
 	}
-#ifdef HAVE_SDL
+#ifdef HAVE_FREETYPE
 
 	// Are we currently printing a bit graphic?
 	if (bitGraph.remBytes > 0) {
 		printBitGraph(ch);
 		return;
 	}
+	// Are we currently loading custom characters?
+	if (udcState != UDC_NONE) {
+		defineUserChar(ch);
+		return;
+	}
 	// Print everything?
 	if (numPrintAsChar > 0) numPrintAsChar--;
 	else if (processCommandChar(ch)) return;
 
-	// Do not print if no font is available
-	if (!curFont) return;
-	if(ch==0x1) ch=0x20;
-	
-	// Find the glyph for the char to render
-	FT_UInt index = FT_Get_Char_Index(curFont, curMap[ch]);
-	
-	// Load the glyph 
-	FT_Load_Glyph(curFont, index, FT_LOAD_DEFAULT);
-
-
-	// Render a high-quality bitmap
-	FT_Render_Glyph(curFont->glyph, FT_RENDER_MODE_NORMAL);
-
-	Bit16u penX = PIXX + curFont->glyph->bitmap_left;
-	Bit16u penY = PIXY - curFont->glyph->bitmap_top + curFont->size->metrics.ascender/64;
+	printRun(&ch, 1);
+#endif // HAVE_FREETYPE
+}
 
-	//if (style & STYLE_SUBSCRIPT) penY += curFont->glyph->bitmap.rows / 2;
-	//if (style & STYLE_HALFHEIGHT) penY += curFont->glyph->bitmap.rows / 4;
-	if (style & STYLE_SUBSCRIPT) penY += 20;
-	if (style & STYLE_SUPERSCRIPT) penY -= 10;
-	if (style & STYLE_HALFHEIGHT) penY += 15;
+void Imagewriter::printString(const Bit8u* buf, Bitu len)
+{
+#ifdef HAVE_FREETYPE
+	bool text = strcasecmp(output, "text") == 0;
+	Bit8u run[IW_RUN_MAX];
 
-	// Copy bitmap into page
-	SDL_LockSurface(page);
+	while (len > 0)
+	{
+		// Bit image data goes to the rasterizer as a whole payload
+		if (!text && page != NULL && bitGraph.remBytes > 0)
+		{
+			charRead = true;
+			Bitu n = printBitGraph(buf, len);
+			buf += n;
+			len -= n;
+			continue;
+		}
 
-	blitGlyph(curFont->glyph->bitmap, penX, penY, false);
-	blitGlyph(curFont->glyph->bitmap, penX+1, penY, true);
+		// Outside of commands and graphics, hand the longest run of printable
+		// characters to the run renderer instead of going byte by byte
+		Bitu n = 0;
+		if (!text && page != NULL && !bitGraph.remBytes && udcState == UDC_NONE &&
+			!ESCSeen && !FSSeen && ESCCmd == 0 && numPrintAsChar == 0)
+		{
+			while (n < len && n < IW_RUN_MAX)
+			{
+				Bit8u ch = buf[n];
+				if (msb != 255) ch &= 0x7F;
+				if (!isPrintable(ch)) break;
+				run[n++] = ch;
+			}
+		}
 
-	// Bold => Print the glyph a second time one pixel to the right
-	// or be a bit more bold...
-	if (style & STYLE_BOLD) {
-		blitGlyph(curFont->glyph->bitmap, penX+1, penY, true);
-		blitGlyph(curFont->glyph->bitmap, penX+2, penY, true);
-		blitGlyph(curFont->glyph->bitmap, penX+3, penY, true);
+		if (n > 1)
+		{
+			charRead = true;
+			printRun(run, n);
+		}
+		else
+		{
+			printChar(buf[0]);
+			n = 1;
+		}
+		buf += n;
+		len -= n;
 	}
-	SDL_UnlockSurface(page);
+#else
+	for (Bitu i=0; i<len; i++)
+		printChar(buf[i]);
+#endif // HAVE_FREETYPE
+}
 
-	// For line printing
-	Bit16u lineStart = PIXX;
-	// Print a slashed zero if the softswitch B-1 is set
-	if(switchb & 1 && ch=='0') slashzero(penX,penY);
-	// advance the cursor to the right
-	Real64 x_advance;
-	if (style &	STYLE_PROP)
-		x_advance = (Real64)((Real64)(curFont->glyph->advance.x)/(Real64)(dpi*64));
-	else {
-		x_advance = 1/(Real64)actcpi;
+#ifdef HAVE_FREETYPE
+bool Imagewriter::isPrintable(Bit8u ch)
+{
+	// Everything processCommandChar() does not treat as a control code
+	switch (ch)
+	{
+	case 0x00: case 0x07: case 0x08: case 0x09: case 0x0a: case 0x0b: case 0x0c: case 0x0d:
+	case 0x0e: case 0x0f: case 0x11: case 0x12: case 0x13: case 0x14: case 0x18: case 0x1b:
+	case 0x1f:
+		return false;
+	default:
+		return true;
 	}
-	x_advance += extraIntraSpace;
-    curX += x_advance;
+}
+
+void Imagewriter::printRun(const Bit8u* run, Bitu len)
+{
+	IWRunGlyph glyphs[IW_RUN_MAX*2];
 
-	// Draw lines if desired
-	if ((score != SCORE_NONE) && (style & 
-		(STYLE_UNDERLINE)))
+	while (len > 0)
 	{
-		// Find out where to put the line
-		Bit16u lineY = PIXY;
-		double height = (curFont->size->metrics.height>>6); // TODO height is fixed point madness...
+		Bitu numGlyphs = 0;
+		Bitu scratchUsed = 0;
+		bool wrap = false;
+		followHead();
 
-		if (style & STYLE_UNDERLINE) lineY = PIXY + (Bit16u)(height*0.9);
+		// For line printing
+		Bitu lineStart = PIXX;
 
-		drawLine(lineStart, PIXX, lineY, score==SCORE_SINGLEBROKEN || score==SCORE_DOUBLEBROKEN);
+		// Compute the pen positions of the whole run up to the point where it wraps
+		Bitu n = 0;
+		while (n < len && !wrap)
+		{
+			Bit8u ch = run[n++];
+			if(ch==0x1) ch=0x20;
 
-		// draw second line if needed
-		if ((score == SCORE_DOUBLE)||(score == SCORE_DOUBLEBROKEN))
-			drawLine(lineStart, PIXX, lineY + 5, score==SCORE_SINGLEBROKEN || score==SCORE_DOUBLEBROKEN);
-	}
-	// If the next character would go beyond the right margin, line-wrap.
-	if((curX + x_advance) > rightMargin) {
-		curX = leftMargin;
-		curY += lineSpacing;
-		if (curY > bottomMargin - lineSpacing) newPage(true,false);
-	}
-#endif // HAVE_SDL
-}
+			Real64 x_advance;
+			if (udcSelected && ch >= 0x20 && ch < 0x80 && udc[ch-0x20].width)
+			{
+				// Downloaded characters are stamped directly and never go through FreeType
+				IWRunGlyph* g = &glyphs[numGlyphs++];
+				g->userChar = ch;
+				g->penX = PIXX;
+				g->penY = PIXY;
+				x_advance = prepareUserChar(ch);
+			}
+			else
+			{
+				// Find the glyph for the char to render. Do not print if no font is available
+				IWGlyph glyph;
+				if (!getGlyph(curMap[ch], &glyph)) continue;
 
-#ifdef HAVE_SDL
-void Imagewriter::blitGlyph(FT_Bitmap bitmap, Bit16u destx, Bit16u desty, bool add) {
-	for (Bitu y=0; y<bitmap.rows; y++) {
-		for (Bitu x=0; x<bitmap.width; x++) {
-			// Read pixel from glyph bitmap
-			Bit8u source = *(bitmap.buffer + x + y*bitmap.pitch);
+				Bitu penX = PIXX + glyph.left;
+				Bitu penY = PIXY - glyph.top + fontAscender/64;
 
-			// Ignore background and don't go over the border
-			if (source > 0 && (destx+x < page->w) && (desty+y < page->h) ) {
-				Bit8u* target = (Bit8u*)page->pixels + (x+destx) + (y+desty)*page->pitch;
-				source>>=3;
-				
-				if (add) {
-					if (((*target)&0x1f )+ source > 31) *target |= (color|0x1f);
-					else {
-						*target += source;
-						*target |= color;
-					}
+				//if (style & STYLE_SUBSCRIPT) penY += glyph.bitmap.rows / 2;
+				//if (style & STYLE_HALFHEIGHT) penY += glyph.bitmap.rows / 4;
+				if (style & STYLE_SUBSCRIPT) penY += 20;
+				if (style & STYLE_SUPERSCRIPT) penY -= 10;
+				if (style & STYLE_HALFHEIGHT) penY += 15;
+
+				addRunGlyph(&glyphs[numGlyphs++], &glyph, curMap[ch], penX, penY, scratchUsed);
+
+				// Print a slashed zero if the softswitch B-1 is set
+				if (switchb & 1 && ch=='0')
+				{
+					IWGlyph slash;
+					if (getGlyph(curMap[0x2f], &slash))
+						addRunGlyph(&glyphs[numGlyphs++], &slash, curMap[0x2f], penX, penY, scratchUsed);
+				}
+
+				// advance the cursor to the right
+				if (style &	STYLE_PROP)
+					x_advance = (Real64)((Real64)(glyph.advance)/(Real64)(dpi*64));
+				else {
+					x_advance = 1/(Real64)actcpi;
 				}
-				else *target = source|color;
 			}
-		}
-	}
-}
+			x_advance += extraIntraSpace;
+			curX += x_advance;
 
-void Imagewriter::drawLine(Bitu fromx, Bitu tox, Bitu y, bool broken)
-{
-	SDL_LockSurface(page);
+			// If the next character would go beyond the right margin, line-wrap.
+			wrap = (curX + x_advance) > rightMargin;
+		}
+		run += n;
+		len -= n;
 
-	Bitu breakmod = dpi / 15;
-	Bitu gapstart = (breakmod * 4)/5;
+		for (Bitu i=0; i<numGlyphs; i++)
+			if (glyphs[i].scratchOffset != (Bitu)-1)
+				glyphs[i].glyph.bitmap.buffer = runScratch + glyphs[i].scratchOffset;
 
-	// Draw anti-aliased line
-	for (Bitu x=fromx; x<=tox; x++)
-	{
-		// Skip parts if broken line or going over the border
-		if ((!broken || (x%breakmod <= gapstart)) && (x < page->w))
+		// Area the run draws into
+		Bitu runLeft = page->w, runTop = page->h, runRight = 0, runBottom = 0;
+		for (Bitu i=0; i<numGlyphs; i++)
 		{
-			if (y > 0 && (y-1) < page->h)
-				*((Bit8u*)page->pixels + x + (y-1)*page->pitch) = 240;
-			if (y < page->h)
-				*((Bit8u*)page->pixels + x + y*page->pitch) = !broken?255:240;
-			if (y+1 < page->h)
-				*((Bit8u*)page->pixels + x + (y+1)*page->pitch) = 240;
+			IWRunGlyph* g = &glyphs[i];
+			Bitu rows = g->glyph.bitmap.rows;
+			Bitu cols = g->glyph.bitmap.width + ((style & STYLE_BOLD) ? 3 : 1);
+			if (g->userChar)
+			{
+				rows = (8*dpi)/72 + 1;
+				cols = (udc[g->userChar - 0x20].width*dpi)/udcStampDpi + 1;
+			}
+			// A pen left of or above the page wrapped around: such glyphs are not printed
+			if (g->penX >= (Bitu)page->w || g->penY >= (Bitu)page->h || rows == 0) continue;
+			if (g->penX < runLeft) runLeft = g->penX;
+			if (g->penY < runTop) runTop = g->penY;
+			if (g->penX + cols > runRight) runRight = g->penX + cols;
+			if (g->penY + rows > runBottom) runBottom = g->penY + rows;
+		}
+		markInk(runLeft, runTop, runRight, runBottom);
+
+		// Copy the bitmaps into page, or the whole line if it was printed before
+		if (runTop < runBottom)
+		{
+			Bit8u* pixels = composeRows(runTop, runBottom);
+			if (!stampCachedRun(pixels, runTop, glyphs, numGlyphs, lineStart, PIXY))
+			{
+				for (Bitu i=0; i<numGlyphs; i++)
+				{
+					IWRunGlyph* g = &glyphs[i];
+					if (g->penX >= (Bitu)page->w || g->penY >= (Bitu)page->h)
+						continue;
+					if (g->userChar)
+						stampUserChar(pixels, runTop, g->userChar, g->penX, g->penY);
+					else
+						blitRunGlyph(pixels, page->w, page->h - runTop, page->pitch, g, g->penX, g->penY - runTop);
+				}
+			}
+		}
+
+		// Draw lines if desired
+		if ((score != SCORE_NONE) && (style & 
+			(STYLE_UNDERLINE)))
+		{
+			// The metrics come with the face, which a run of downloaded characters never loads
+			if (curAtlas == NULL && curFont == NULL)
+				loadFace();
+
+			// Find out where to put the line
+			Bitu lineY = PIXY;
+			double height = (fontHeight>>6); // TODO height is fixed point madness...
+
+			if (style & STYLE_UNDERLINE) lineY = PIXY + (Bitu)(height*0.9);
+
+			drawLine(lineStart, PIXX, lineY, score==SCORE_SINGLEBROKEN || score==SCORE_DOUBLEBROKEN);
+
+			// draw second line if needed
+			if ((score == SCORE_DOUBLE)||(score == SCORE_DOUBLEBROKEN))
+				drawLine(lineStart, PIXX, lineY + 5, score==SCORE_SINGLEBROKEN || score==SCORE_DOUBLEBROKEN);
+		}
+
+		if (wrap) {
+			curX = leftMargin;
+			curY += lineSpacing;
+			if (curY > bottomMargin - lineSpacing) newPage(true,false);
+		}
+	}
+}
+
+void Imagewriter::blitRunGlyph(Bit8u* pixels, Bitu w, Bitu h, Bitu pitch, const IWRunGlyph* g, Bitu x, Bitu y)
+{
+	blitGlyph(pixels, w, h, pitch, g->glyph.bitmap, x, y, false);
+	blitGlyph(pixels, w, h, pitch, g->glyph.bitmap, x+1, y, true);
+
+	// Bold => Print the glyph a second time one pixel to the right
+	// or be a bit more bold...
+	if (style & STYLE_BOLD) {
+		blitGlyph(pixels, w, h, pitch, g->glyph.bitmap, x+1, y, true);
+		blitGlyph(pixels, w, h, pitch, g->glyph.bitmap, x+2, y, true);
+		blitGlyph(pixels, w, h, pitch, g->glyph.bitmap, x+3, y, true);
+	}
+}
+
+bool Imagewriter::stampCachedRun(Bit8u* pixels, Bitu top, IWRunGlyph* glyphs, Bitu numGlyphs, Bitu originX, Bitu originY)
+{
+	// A glyph pixel printed in color 0 could be left blank, see below
+	if (numGlyphs < IW_LINECACHE_MIN || lineCache == NULL || color == 0)
+		return false;
+
+	// Key: everything that changes the pixels of the segment. The pen offsets
+	// from the origin stand in for the sub-pixel x phase of the start position.
+	Bit8u key[8 + IW_RUN_MAX*2*10];
+	Bitu keyLen = 0;
+	key[keyLen++] = (Bit8u)LQtypeFace;
+	key[keyLen++] = fontItalic;
+	key[keyLen++] = (style & STYLE_BOLD) != 0;
+	key[keyLen++] = color;
+	key[keyLen++] = fontHorizPoints & 0xff;
+	key[keyLen++] = fontHorizPoints >> 8;
+	key[keyLen++] = fontVertPoints & 0xff;
+	key[keyLen++] = fontVertPoints >> 8;
+
+	Bitu x0 = page->w, y0 = page->h, x1 = 0, y1 = 0;
+	Bitu extra = (style & STYLE_BOLD) ? 3 : 1;
+	for (Bitu i=0; i<numGlyphs; i++)
+	{
+		IWRunGlyph* g = &glyphs[i];
+		// Downloaded characters and glyphs clipped by the page border are not cached
+		if (g->userChar || g->penX >= (Bitu)page->w || g->penY >= (Bitu)page->h ||
+			g->penX + g->glyph.bitmap.width + extra > (Bitu)page->w ||
+			g->penY + g->glyph.bitmap.rows > (Bitu)page->h)
+			return false;
+
+		Bitu dx = g->penX - originX;
+		Bitu dy = g->penY - originY;
+		key[keyLen++] = g->code & 0xff;
+		key[keyLen++] = g->code >> 8;
+		for (Bitu b=0; b<32; b += 8)
+		{
+			key[keyLen++] = (dx >> b) & 0xff;
+			key[keyLen++] = (dy >> b) & 0xff;
+		}
+
+		if (g->glyph.bitmap.width == 0 || g->glyph.bitmap.rows == 0) continue;
+		if (g->penX < x0) x0 = g->penX;
+		if (g->penY < y0) y0 = g->penY;
+		if (g->penX + g->glyph.bitmap.width + extra > x1) x1 = g->penX + g->glyph.bitmap.width + extra;
+		if (g->penY + g->glyph.bitmap.rows > y1) y1 = g->penY + g->glyph.bitmap.rows;
+	}
+	// The strip geometry is kept in 16 bits
+	if (x1 <= x0 || y1 <= y0 || x1 - x0 > 0xFFFF || y1 - y0 > 0xFFFF ||
+		x0 - originX + 0x8000 > 0xFFFF || y0 - originY + 0x8000 > 0xFFFF)
+		return false;
+
+	Bit32u hash = IWLineCache::hashKey(key, keyLen);
+	const IWLineStrip* strip = lineCache->find(key, keyLen, hash);
+	bool hit = strip != NULL;
+	if (!hit)
+	{
+		if (!lineCache->admit(hash))
+		{
+			lineCache->misses++;
+			return false;
+		}
+
+		// The line comes back: render it once on a blank strip
+		IWLineStrip* added = lineCache->store(key, keyLen, hash, (Bit16s)(x0 - originX), (Bit16s)(y0 - originY), x1 - x0, y1 - y0);
+		if (added == NULL)
+		{
+			lineCache->misses++;
+			return false;
+		}
+		for (Bitu i=0; i<numGlyphs; i++)
+			blitRunGlyph(added->pixels, added->w, added->h, added->w, &glyphs[i], glyphs[i].penX - x0, glyphs[i].penY - y0);
+		strip = added;
+	}
+
+	// The strip holds the result of the blits on a blank page. Every pixel a glyph
+	// touches carries the color bits, so as long as those pixels are still blank
+	// on the page, OR-ing the strip in gives exactly what the blits would.
+	Bit8u* target = pixels + (originY + strip->y - top)*page->pitch + (originX + strip->x);
+	for (Bitu y=0; y<strip->h; y++)
+	{
+		const Bit8u* row = target + y*page->pitch;
+		const Bit8u* source = strip->pixels + y*strip->w;
+		Bitu overlap = 0;
+		for (Bitu x=0; x<strip->w; x++)
+			overlap |= (row[x] != 0) & (source[x] != 0);
+		if (overlap)
+		{
+			lineCache->misses++;
+			return false;
+		}
+	}
+	for (Bitu y=0; y<strip->h; y++)
+	{
+		Bit8u* row = target + y*page->pitch;
+		const Bit8u* source = strip->pixels + y*strip->w;
+		for (Bitu x=0; x<strip->w; x++)
+			row[x] |= source[x];
+	}
+	if (hit) lineCache->hits++;
+	else lineCache->misses++;
+	return true;
+}
+
+void Imagewriter::addRunGlyph(IWRunGlyph* g, const IWGlyph* glyph, Bit16u code, Bitu penX, Bitu penY, Bitu& scratchUsed)
+{
+	g->glyph = *glyph;
+	g->code = code;
+	g->penX = penX;
+	g->penY = penY;
+	g->userChar = 0;
+	g->scratchOffset = (Bitu)-1;
+
+	// Atlas bitmaps stay put, but the FreeType glyph slot is reused by the next
+	// character. Keep a copy until the run is blitted.
+	if (curFont != NULL && glyph->bitmap.buffer == curFont->glyph->bitmap.buffer)
+	{
+		Bitu size = glyph->bitmap.rows * glyph->bitmap.pitch;
+		if (scratchUsed + size > runScratchSize)
+		{
+			runScratchSize = (scratchUsed + size) * 2;
+			runScratch = (Bit8u*)realloc(runScratch, runScratchSize);
+		}
+		if (size)
+			memcpy(runScratch + scratchUsed, glyph->bitmap.buffer, size);
+		g->scratchOffset = scratchUsed;
+		scratchUsed += size;
+	}
+}
+
+void Imagewriter::defineUserChar(Bit8u ch)
+{
+	switch (udcState)
+	{
+	case UDC_CODE:
+		if (ch == 0x04) // CTRL-D ends the download
+			udcState = UDC_NONE;
+		else if (ch >= 0x20 && ch < 0x80)
+		{
+			udcSlot = ch - 0x20;
+			udcState = UDC_WIDTH;
+		}
+		// anything else (CR/LF between definitions) is skipped
+		break;
+	case UDC_WIDTH:
+		if (ch >= 'A' && ch <= 'P')
+		{
+			udc[udcSlot].width = 0;
+			udcRead = ch - 'A' + 1;
+			memset(udc[udcSlot].columns, 0, sizeof(udc[udcSlot].columns));
+			udcState = UDC_DATA;
+		}
+		else udcState = UDC_NONE; // Not a definition, give up on the download
+		break;
+	case UDC_DATA:
+		udc[udcSlot].columns[udc[udcSlot].width++] = ch;
+		if (udc[udcSlot].width == udcRead)
+		{
+			if (udcStamps) udcStamps[udcSlot].valid = false;
+			udcState = UDC_CODE;
+		}
+		break;
+	}
+}
+
+void Imagewriter::renderUserChar(Bit8u slot)
+{
+	userCharStamp* stamp = &udcStamps[slot];
+	userDefinedChar* def = &udc[slot];
+
+	// Columns are spaced at the graphics density of the current pitch, pins at 1/72 inch.
+	// Each horizontal run of dots in a pin row becomes one rectangle.
+	stamp->numRects = 0;
+	for (Bitu bit=0; bit<8; bit++)
+	{
+		Bitu y = (bit*dpi)/72;
+		Bitu h = ((bit+1)*dpi)/72 - y;
+		Bitu col = 0;
+		while (col < def->width)
+		{
+			if (!(def->columns[col] & (1<<bit))) {
+				col++;
+				continue;
+			}
+			Bitu start = col;
+			while (col < def->width && (def->columns[col] & (1<<bit)))
+				col++;
+			Bitu x = (start*dpi)/udcStampDpi;
+			Bitu w = (col*dpi)/udcStampDpi - x;
+			stamp->rects[stamp->numRects].x = x;
+			stamp->rects[stamp->numRects].y = y;
+			stamp->rects[stamp->numRects].w = w > 0 ? w : 1;
+			stamp->rects[stamp->numRects].h = h > 0 ? h : 1;
+			stamp->numRects++;
 		}
 	}
-	SDL_UnlockSurface(page);
+	stamp->valid = true;
+}
+
+Real64 Imagewriter::prepareUserChar(Bit8u ch)
+{
+	Bit8u slot = ch - 0x20;
+	Bit16u density = definedUnit > 0 ? (Bit16u)definedUnit : 72;
+	if (style & STYLE_DOUBLEWIDTH) density /= 2;
+
+	if (udcStamps == NULL)
+		udcStamps = (userCharStamp*)calloc(96, sizeof(userCharStamp));
+	if (density != udcStampDpi)
+	{
+		for (Bitu i=0; i<96; i++)
+			udcStamps[i].valid = false;
+		udcStampDpi = density;
+	}
+	if (!udcStamps[slot].valid)
+		renderUserChar(slot);
+
+	if (style & STYLE_PROP)
+		return (Real64)udc[slot].width/(Real64)density;
+	return 1/(Real64)actcpi;
+}
+
+void Imagewriter::stampUserChar(Bit8u* pixels, Bitu top, Bit8u ch, Bitu penX, Bitu penY)
+{
+	userCharStamp* stamp = &udcStamps[ch - 0x20];
+
+	for (Bitu i=0; i<stamp->numRects; i++)
+	{
+		Bitu x0 = penX + stamp->rects[i].x;
+		Bitu y0 = penY + stamp->rects[i].y;
+		Bitu x1 = x0 + stamp->rects[i].w;
+		Bitu y1 = y0 + stamp->rects[i].h;
+		if (x1 > (Bitu)page->w) x1 = page->w;
+		if (y1 > (Bitu)page->h) y1 = page->h;
+		for (Bitu y=y0; y<y1; y++)
+		{
+			Bit8u* target = pixels + (y - top)*page->pitch;
+			for (Bitu x=x0; x<x1; x++)
+				target[x] |= (color|0x1F);
+		}
+	}
+}
+#endif // HAVE_FREETYPE
+
+#ifdef HAVE_FREETYPE
+void Imagewriter::blitGlyph(Bit8u* pixels, Bitu w, Bitu h, Bitu pitch, FT_Bitmap bitmap, Bitu destx, Bitu desty, bool add) {
+	for (Bitu y=0; y<bitmap.rows; y++) {
+		for (Bitu x=0; x<bitmap.width; x++) {
+			// Read pixel from glyph bitmap
+			Bit8u source = *(bitmap.buffer + x + y*bitmap.pitch);
+
+			// Ignore background and don't go over the border
+			if (source > 0 && (destx+x < w) && (desty+y < h) ) {
+				Bit8u* target = pixels + (x+destx) + (y+desty)*pitch;
+				source>>=3;
+				
+				if (add) {
+					if (((*target)&0x1f )+ source > 31) *target |= (color|0x1f);
+					else {
+						*target += source;
+						*target |= color;
+					}
+				}
+				else *target = source|color;
+			}
+		}
+	}
+}
+
+void Imagewriter::drawLine(Bitu fromx, Bitu tox, Bitu y, bool broken)
+{
+	Bitu top = y > 0 ? y-1 : 0;
+	Bit8u* pixels = composeRows(top, y+2);
+	markInk(fromx, top, tox+1, y+2);
+
+	Bitu breakmod = dpi / 15;
+	Bitu gapstart = (breakmod * 4)/5;
+
+	// Draw anti-aliased line
+	for (Bitu x=fromx; x<=tox; x++)
+	{
+		// Skip parts if broken line or going over the border
+		if ((!broken || (x%breakmod <= gapstart)) && (x < page->w))
+		{
+			if (y > 0 && (y-1) < page->h)
+				*(pixels + x + (y-1 - top)*page->pitch) = 240;
+			if (y < page->h)
+				*(pixels + x + (y - top)*page->pitch) = !broken?255:240;
+			if (y+1 < page->h)
+				*(pixels + x + (y+1 - top)*page->pitch) = 240;
+		}
+	}
+}
+
+Bit8u* Imagewriter::composeRows(Bitu top, Bitu bottom)
+{
+	if (bottom > (Bitu)page->h) bottom = page->h;
+	if (top >= bottom)
+		return band;
+
+	if (top < bandTop || bottom > bandTop + bandRows)
+	{
+		mergeBand();
+
+		// Taller than a head pass (big characters): make room
+		if (bottom - top > bandCapacity)
+		{
+			bandCapacity = bottom - top;
+			page->freeRows(band);
+			band = page->allocRows(bandCapacity*page->pitch);
+		}
+
+		// Load the band from the page. Rows below the ink so far are still white.
+		bandTop = top;
+		bandRows = page->h - top < bandCapacity ? page->h - top : bandCapacity;
+		Bitu inked = inkBottom > bandTop ? inkBottom - bandTop : 0;
+		if (inked > bandRows) inked = bandRows;
+		readPageRows(bandTop, inked, band);
+		memset(band + inked*page->pitch, 0, (bandRows - inked)*page->pitch);
+		bandDirtyTop = bandDirtyEnd = top;
+	}
+
+	if (bandDirtyEnd == bandDirtyTop) bandDirtyTop = top;
+	else if (top < bandDirtyTop) bandDirtyTop = top;
+	if (bottom > bandDirtyEnd) bandDirtyEnd = bottom;
+	return band + (top - bandTop)*page->pitch;
+}
+
+void Imagewriter::markInk(Bitu left, Bitu top, Bitu right, Bitu bottom)
+{
+	if (right > (Bitu)page->w) right = page->w;
+	if (bottom > (Bitu)page->h) bottom = page->h;
+	if (left >= right || top >= bottom)
+		return;
+	if (left < inkLeft) inkLeft = left;
+	if (top < inkTop) inkTop = top;
+	if (right > inkRight) inkRight = right;
+	if (bottom > inkBottom) inkBottom = bottom;
+}
+
+void Imagewriter::mergeBand()
+{
+	if (bandDirtyEnd > bandDirtyTop)
+	{
+		writePageRows(bandDirtyTop, bandDirtyEnd - bandDirtyTop, band + (bandDirtyTop - bandTop)*page->pitch);
+	}
+	bandRows = 0;
+	bandDirtyTop = bandDirtyEnd = 0;
+}
+
+Bit8u* Imagewriter::tileRow(Bitu y, bool alloc)
+{
+	Bitu i = y / IW_TILE_ROWS;
+	if (tiles[i] == NULL)
+	{
+		if (tileSpill[i] >= 0)
+			loadTile(i);
+		else if (!alloc)
+			return NULL;
+		else
+		{
+			tiles[i] = takeTile(i, false);
+			memset(tiles[i], 0, tileBytes);
+			numInkedTiles++;
+		}
+	}
+	return tiles[i] + (y % IW_TILE_ROWS) * (monoPage ? monoPitch : page->pitch);
+}
+
+// fseek with 64 bit offsets, the spill file of a big page outgrows a long on some systems
+static int seekFile(FILE* f, Bit64s offset)
+{
+#if defined (WIN32)
+	return _fseeki64(f, offset, SEEK_SET);
+#else
+	return fseeko(f, (off_t)offset, SEEK_SET);
+#endif
+}
+
+Bit8u* Imagewriter::takeTile(Bitu keep, bool color)
+{
+	Bitu colorBytes = IW_TILE_ROWS * page->pitch;
+	Bitu bytes = color ? colorBytes : tileBytes;
+	Bit8u* tile = NULL;
+	pinnedTile = keep;
+	while (numResidentTiles >= IW_MIN_RESIDENT_TILES)
+	{
+		// Within the page budget, and as long as the shared pool has room. Else make room
+		// and try again.
+		Bit64u resident = (Bit64u)numResidentTiles*tileBytes + (Bit64u)numResidentColors*colorBytes;
+		if (pageBudget == 0 || resident + bytes <= pageBudget)
+			tile = page->leaseRows(bytes);
+		if (tile != NULL || !dropTile(keep))
+			break;
+	}
+
+	// Below the fewest strips worth keeping the block is forced, which over the pool budget
+	// still has the pages spill strips other than keep for it
+	if (tile == NULL)
+		tile = page->allocRows(bytes);
+	pinnedTile = numTiles;
+	if (color)
+		numResidentColors++;
+	else
+		numResidentTiles++;
+	return tile;
+}
+
+bool Imagewriter::dropTile(Bitu keep)
+{
+	// Strips above are done with, both while the head moves down the page and while
+	// the encoders read it. Else give up the one farthest down.
+	Bitu victim = numTiles;
+	for (Bitu i=0; i<keep && victim == numTiles; i++)
+		if (tiles[i] != NULL) victim = i;
+	for (Bitu i=numTiles-1; i>keep && victim == numTiles; i--)
+		if (tiles[i] != NULL) victim = i;
+	if (victim == numTiles || !spillTile(victim))
+		return false;
+
+	// Its color plane goes with it
+	page->freeRows(tiles[victim]);
+	tiles[victim] = NULL;
+	numResidentTiles--;
+	if (colorTiles[victim] != NULL)
+	{
+		page->freeRows(colorTiles[victim]);
+		colorTiles[victim] = NULL;
+		numResidentColors--;
+	}
+	return true;
+}
+
+bool Imagewriter::reclaimTile(void* owner)
+{
+	Imagewriter* iw = (Imagewriter*)owner;
+	return iw->dropTile(iw->pinnedTile);
+}
+
+bool Imagewriter::spillTile(Bitu i)
+{
+	if (tileSaved[i])
+		return true;
+	if (spillFile == NULL)
+	{
+		spillFile = tmpfile();
+		if (spillFile == NULL)
+		{
+			printf("Printer: can't create a spill file, the page goes over the memory budget\n");
+			pageBudget = 0;
+			return false;
+		}
+	}
+	Bitu colorBytes = IW_TILE_ROWS * page->pitch;
+	if (tileSpill[i] < 0)
+	{
+		tileSpill[i] = spillEnd;
+		spillEnd += tileBytes;
+	}
+	if (colorTiles[i] != NULL && colorSpill[i] < 0)
+	{
+		colorSpill[i] = spillEnd;
+		spillEnd += colorBytes;
+	}
+	if (seekFile(spillFile, tileSpill[i]) != 0 || fwrite(tiles[i], 1, tileBytes, spillFile) != tileBytes ||
+		(colorTiles[i] != NULL &&
+		(seekFile(spillFile, colorSpill[i]) != 0 || fwrite(colorTiles[i], 1, colorBytes, spillFile) != colorBytes)))
+	{
+		printf("Printer: writing the spill file failed, the page goes over the memory budget\n");
+		pageBudget = 0;
+		return false;
+	}
+	tileSaved[i] = true;
+	return true;
+}
+
+void Imagewriter::loadTile(Bitu i)
+{
+	tiles[i] = takeTile(i, false);
+	tileSaved[i] = seekFile(spillFile, tileSpill[i]) == 0 && fread(tiles[i], 1, tileBytes, spillFile) == tileBytes;
+	if (!tileSaved[i])
+		memset(tiles[i], 0, tileBytes);
+	if (colorSpill[i] >= 0)
+	{
+		Bitu colorBytes = IW_TILE_ROWS * page->pitch;
+		colorTiles[i] = takeTile(i, true);
+		if (seekFile(spillFile, colorSpill[i]) != 0 || fread(colorTiles[i], 1, colorBytes, spillFile) != colorBytes)
+		{
+			memset(colorTiles[i], 0, colorBytes);
+			tileSaved[i] = false;
+		}
+	}
+	if (!tileSaved[i])
+		printf("Printer: reading the spill file failed, strip %u of the page is lost\n", i);
+}
+
+void Imagewriter::readPageRows(Bitu top, Bitu rows, Bit8u* dst)
+{
+	for (Bitu y=top; y<top+rows; y++, dst += page->pitch)
+	{
+		const Bit8u* row = tileRow(y, false);
+		if (row == NULL)
+			memset(dst, 0, page->pitch);
+		else if (!monoPage)
+			memcpy(dst, row, page->pitch);
+		else
+		{
+			// The color plane with the black ink on top
+			const Bit8u* colors = colorRow(y, false);
+			if (colors != NULL)
+				memcpy(dst, colors, page->pitch);
+			else
+				memset(dst, 0, page->pitch);
+			for (Bitu i=0; i<monoPitch; i++)
+			{
+				if (row[i] == 0) continue;
+				for (Bitu b=0; b<8; b++)
+					if (row[i] & (0x80>>b))
+						dst[i*8 + b] = COLOR_BLACK|0x1F;
+			}
+		}
+	}
+}
+
+// Packs 8-bit pixels to 1 bit (MSB first), keeping those of at least half intensity as ink
+static void packRow(const Bit8u* src, Bitu width, Bit8u* dst)
+{
+	for (Bitu x=0; x<width; x += 8)
+	{
+		Bit8u bits = 0;
+		for (Bitu i=0; i<8 && x+i<width; i++)
+			if ((src[x+i] & 0x1F) >= 16)
+				bits |= 0x80>>i;
+		dst[x>>3] = bits;
+	}
+}
+
+// Splits 8-bit pixels of a packed page: black ink of at least half intensity goes to the
+// bits (MSB first), everything printed with a ribbon color stays for the color plane. Returns
+// true if there was any such color
+static bool packBlackRow(const Bit8u* src, Bitu width, Bit8u* dst)
+{
+	bool colors = false;
+	for (Bitu x=0; x<width; x += 8)
+	{
+		Bit8u bits = 0;
+		for (Bitu i=0; i<8 && x+i<width; i++)
+		{
+			Bit8u ribbons = src[x+i] >> 5;
+			if (ribbons != 0 && ribbons != 7)
+				colors = true;
+			else if ((src[x+i] & 0x1F) >= 16)
+				bits |= 0x80>>i;
+		}
+		dst[x>>3] = bits;
+	}
+	return colors;
+}
+
+void Imagewriter::writePageRows(Bitu top, Bitu rows, const Bit8u* src)
+{
+	rowScratchY = (Bitu)-1;
+	for (Bitu y=top; y<top+rows; y++, src += page->pitch)
+	{
+		const Bit8u* source = src;
+		Bitu rowBytes = page->pitch;
+		bool colors = false;
+		if (monoPage)
+		{
+			colors = packBlackRow(src, page->w, packScratch);
+			source = packScratch;
+			rowBytes = monoPitch;
+		}
+
+		// White rows don't bring a strip to life
+		Bit8u* row = tileRow(y, false);
+		if (row == NULL)
+		{
+			if (!colors && memcmp(source, whiteRow, rowBytes) == 0)
+				continue;
+			row = tileRow(y, true);
+		}
+		memcpy(row, source, rowBytes);
+		tileSaved[y / IW_TILE_ROWS] = false;
+
+		// The color plane only takes the ribbon colors: black ink is the bits' alone, so faint
+		// black drops out the same with or without a color plane in the strip
+		Bit8u* plane = monoPage ? colorRow(y, colors) : NULL;
+		if (plane != NULL)
+		{
+			for (Bitu x=0; x<(Bitu)page->w; x++)
+				plane[x] = (Bitu)(src[x]>>5) - 1 < 6 ? src[x] : 0;
+		}
+	}
+}
+
+const Bit8u* Imagewriter::pageRow(Bitu y)
+{
+	const Bit8u* row = tileRow(y, false);
+	if (row == NULL)
+		return whiteRow;
+	if (!monoPage)
+		return row;
+	if (rowScratchY != y)
+	{
+		readPageRows(y, 1, rowScratch);
+		rowScratchY = y;
+	}
+	return rowScratch;
+}
+
+const Bit8u* Imagewriter::packedRow(Bitu y)
+{
+	const Bit8u* row = tileRow(y, false);
+	return row != NULL ? row : whiteRow;
+}
+
+Bit8u* Imagewriter::colorRow(Bitu y, bool alloc)
+{
+	Bitu i = y / IW_TILE_ROWS;
+	if (tiles[i] == NULL && colorSpill[i] >= 0)
+		loadTile(i);
+	if (colorTiles[i] == NULL)
+	{
+		if (!alloc)
+			return NULL;
+		colorTiles[i] = takeTile(i, true);
+		memset(colorTiles[i], 0, IW_TILE_ROWS * page->pitch);
+		numColorTiles++;
+	}
+	return colorTiles[i] + (y % IW_TILE_ROWS) * page->pitch;
+}
+
+bool Imagewriter::bilevelPage()
+{
+	mergeBand();
+	return monoPage && numColorTiles == 0;
+}
+
+bool Imagewriter::isWhiteRow(Bitu y)
+{
+	return tiles[y / IW_TILE_ROWS] == NULL && tileSpill[y / IW_TILE_ROWS] < 0;
+}
+
+void Imagewriter::clearPage()
+{
+	bool mono = s_mono_pages;
+	Bitu bytes = IW_TILE_ROWS * (mono ? monoPitch : page->pitch);
+
+	// Strips of the old page go back to the pool for the next one
+	for (Bitu i=0; i<numTiles; i++)
+	{
+		tileSpill[i] = -1;
+		colorSpill[i] = -1;
+		tileSaved[i] = false;
+		page->freeRows(tiles[i]);
+		tiles[i] = NULL;
+		page->freeRows(colorTiles[i]);
+		colorTiles[i] = NULL;
+	}
+	numInkedTiles = 0;
+	numResidentTiles = 0;
+	numColorTiles = 0;
+	numResidentColors = 0;
+	spillEnd = 0;
+	rowScratchY = (Bitu)-1;
+	tileBytes = bytes;
+	monoPage = mono;
+}
+
+bool Imagewriter::savePageBMP(const char* fname)
+{
+	FILE* f = fopen(fname, "wb");
+	if (!f)
+		return false;
+
+	// Rows bottom-up and padded to 4 bytes, 1 bit per pixel for a packed page without color
+	bool bilevel = bilevelPage();
+	Bitu rowBytes = bilevel ? (monoPitch + 3) & ~3 : (page->w + 3) & ~3;
+	fwriteBMPHeader(f, bilevel ? 1 : 8, page->h);
+
+	Bit8u pad[4] = { 0, 0, 0, 0 };
+	for (Bitu y=page->h; y-- > 0; )
+	{
+		if (bilevel)
+		{
+			fwrite(packedRow(y), 1, monoPitch, f);
+			fwrite(pad, 1, rowBytes - monoPitch, f);
+		}
+		else
+			fwrite(pageRow(y), 1, rowBytes, f);
+	}
+	bool ok = !ferror(f);
+	fclose(f);
+	return ok;
+}
+
+void Imagewriter::fwriteBMPHeader(FILE* f, Bitu bits, Bit32s height)
+{
+	// A 1 bit image has a two color palette, where index 1 (ink) is black
+	Bitu numColors = bits == 1 ? 2 : 256;
+	Bitu rowBytes = bits == 1 ? (monoPitch + 3) & ~3 : (page->w + 3) & ~3;
+	Bit32u rows = height < 0 ? -height : height;
+	Bit32u offset = 14 + 40 + numColors*4;
+	Bit32u size = offset + rowBytes*rows;
+	Bit8u header[14 + 40];
+	memset(header, 0, sizeof(header));
+	header[0] = 'B';
+	header[1] = 'M';
+	for (Bitu i=0; i<4; i++)
+	{
+		header[2+i] = (Bit8u)(size >> (8*i));
+		header[10+i] = (Bit8u)(offset >> (8*i));
+		header[18+i] = (Bit8u)((Bit32u)page->w >> (8*i));
+		header[22+i] = (Bit8u)((Bit32u)height >> (8*i));
+		header[34+i] = (Bit8u)((Bit32u)(rowBytes*rows) >> (8*i));
+		header[46+i] = (Bit8u)((Bit32u)numColors >> (8*i));
+	}
+	header[14] = 40;
+	header[26] = 1;						// Planes
+	header[28] = bits;
+	fwrite(header, 1, sizeof(header), f);
+
+	for (Bitu i=0; i<numColors; i++)
+	{
+		Bit8u entry[4] = { 0, 0, 0, 0 };
+		if (bits == 1)
+			entry[0] = entry[1] = entry[2] = i ? 0 : 0xFF;
+		else
+		{
+			entry[0] = page->palette[i].b;
+			entry[1] = page->palette[i].g;
+			entry[2] = page->palette[i].r;
+		}
+		fwrite(entry, 1, 4, f);
+	}
 }
 
 void Imagewriter::setAutofeed(bool feed) {
@@ -1439,13 +2609,105 @@ bool Imagewriter::isBusy() {
 	return false;
 }
 
-bool Imagewriter::ack() {
-	// Acknowledge last char read
-	if(charRead) {
-		charRead=false;
-		return true;
+bool Imagewriter::ack() {
+	// Acknowledge last char read
+	if(charRead) {
+		charRead=false;
+		return true;
+	}
+	return false;
+}
+
+// Runs of set bits in a byte, bit 0 (top pin) first
+static struct {
+	Bit8u count;
+	Bit8u start[4], len[4];
+} bitRuns[256];
+
+// ORs ink into width pixels of a row
+static inline void orSpan(Bit8u* row, Bitu width, Bit8u ink)
+{
+	for (Bitu x=0; x<width; x++)
+		row[x] |= ink;
+}
+
+static void initBitRuns()
+{
+	for (Bitu v=0; v<256; v++)
+	{
+		bitRuns[v].count = 0;
+		for (Bitu b=0; b<8; b++)
+		{
+			if (!(v & (1<<b))) continue;
+			if (b > 0 && (v & (1<<(b-1))))
+				bitRuns[v].len[bitRuns[v].count-1]++;
+			else
+			{
+				bitRuns[v].start[bitRuns[v].count] = b;
+				bitRuns[v].len[bitRuns[v].count] = 1;
+				bitRuns[v].count++;
+			}
+		}
+	}
+}
+
+// Bit image columns at SX pixels per dot, with pins SY rows high or, for SY = 0,
+// on the rows of the plan. The block must lie within the page.
+template <Bitu BYTES, Bitu SX, Bitu SY>
+static void rasterFixedColumns(const IWBitPlan* plan, const Bit8u* data, Bitu numCols, Bit8u* target, Bitu pitch, Bit8u ink)
+{
+	Bitu y0 = plan->yStart[0];
+	for (Bitu c=0; c<numCols; c++, data += BYTES, target += SX)
+	{
+		for (Bitu i=0; i<BYTES; i++)
+		{
+			Bit8u v = data[i];
+			for (Bitu r=0; r<bitRuns[v].count; r++)
+			{
+				Bitu first = i*8 + bitRuns[v].start[r];
+				Bitu last = first + bitRuns[v].len[r] - 1;
+				Bit8u* row = target + (SY ? first*SY : plan->yStart[first] - y0)*pitch;
+				Bit8u* end = target + (SY ? (last+1)*SY : plan->yEnd[last] - y0)*pitch;
+				for (; row<end; row += pitch)
+					for (Bitu x=0; x<SX; x++)
+						row[x] |= ink;
+			}
+		}
+	}
+}
+
+template <Bitu BYTES, Bitu SY>
+static IWBitKernel findBitKernelX(Bitu scaleX)
+{
+	switch (scaleX)
+	{
+	case 1: return rasterFixedColumns<BYTES, 1, SY>;
+	case 2: return rasterFixedColumns<BYTES, 2, SY>;
+	case 3: return rasterFixedColumns<BYTES, 3, SY>;
+	case 4: return rasterFixedColumns<BYTES, 4, SY>;
+	case 6: return rasterFixedColumns<BYTES, 6, SY>;
+	case 8: return rasterFixedColumns<BYTES, 8, SY>;
+	}
+	return NULL;
+}
+
+// Kernel for the pixels per dot of a bit image at 144, 288 or 576 dpi, or NULL.
+// scaleY is 0 if the pins don't map onto whole rows (LQ 216 dpi).
+static IWBitKernel findBitKernel(Bitu bytesColumn, Bitu scaleX, Bitu scaleY)
+{
+	if (bytesColumn == 1)
+	{
+		switch (scaleY)
+		{
+		case 0: return findBitKernelX<1, 0>(scaleX);
+		case 2: return findBitKernelX<1, 2>(scaleX);
+		case 4: return findBitKernelX<1, 4>(scaleX);
+		case 8: return findBitKernelX<1, 8>(scaleX);
+		}
 	}
-	return false;
+	else if (bytesColumn == 3 && scaleY == 0)
+		return findBitKernelX<3, 0>(scaleX);
+	return NULL;
 }
 
 void Imagewriter::setupBitImage(Bit8u dens, Bit16u numCols) {
@@ -1555,144 +2817,757 @@ void Imagewriter::setupBitImage(Bit8u dens, Bit16u numCols) {
 
 	bitGraph.remBytes = numCols * bitGraph.bytesColumn;
 	bitGraph.readBytesColumn = 0;
+
+	// Densities that divide the page dpi get an unrolled rasterizer
+	bitGraph.kernel = NULL;
+	if (bitGraph.horizDens && bitGraph.vertDens && dpi % bitGraph.horizDens == 0)
+		bitGraph.kernel = findBitKernel(bitGraph.bytesColumn, dpi / bitGraph.horizDens,
+			dpi % bitGraph.vertDens == 0 ? dpi / bitGraph.vertDens : 0);
+}
+
+void Imagewriter::printBitGraph(Bit8u ch)
+{
+	printBitGraph(&ch, 1);
+}
+
+Bitu Imagewriter::printBitGraph(const Bit8u* data, Bitu len)
+{
+	if (len > bitGraph.remBytes)
+		len = bitGraph.remBytes;
+
+	Bitu used = 0;
+
+	// Finish a column that was split between two calls
+	while (bitGraph.readBytesColumn > 0 && used < len)
+	{
+		bitGraph.column[bitGraph.readBytesColumn++] = data[used++];
+		if (bitGraph.readBytesColumn == bitGraph.bytesColumn)
+		{
+			rasterBitColumns(bitGraph.column, 1);
+			bitGraph.readBytesColumn = 0;
+		}
+	}
+
+	// All complete columns straight from the payload. A block that arrives
+	// in one piece may have been printed before.
+	Bitu numCols = (len - used) / bitGraph.bytesColumn;
+	bool wholeBlock = used == 0 && len == bitGraph.remBytes;
+	if (!wholeBlock || !stampCachedBlock(data, numCols))
+		rasterBitColumns(data + used, numCols);
+	used += numCols * bitGraph.bytesColumn;
+
+	// Keep the start of the next column
+	while (used < len)
+		bitGraph.column[bitGraph.readBytesColumn++] = data[used++];
+
+	bitGraph.remBytes -= len;
+	return len;
+}
+
+static Bitu gcd(Bitu a, Bitu b)
+{
+	while (b)
+	{
+		Bitu t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+void Imagewriter::setupDotScale(IWDotScale* scale, Bit16u density)
+{
+	if (scale->density == density)
+		return;
+
+	// Dot n of the grid starts at pixel floor(n*dpi/density + 1/2). The offsets
+	// repeat every density/gcd dots, which are dpi/gcd pixels wide.
+	Bitu g = gcd(dpi, density);
+	scale->density = density;
+	scale->period = density / g;
+	scale->stride = dpi / g;
+	for (Bitu n=0; n<=scale->period; n++)
+		scale->offset[n] = (2*n*dpi + density) / (2*density);
+}
+
+void Imagewriter::planBitImage(IWBitPlan* plan)
+{
+	static bool bitRunsReady = false;
+	if (!bitRunsReady)
+	{
+		initBitRuns();
+		bitRunsReady = true;
+	}
+
+	setupDotScale(&scaleX, bitGraph.horizDens);
+	setupDotScale(&scaleY, bitGraph.vertDens);
+	followHead();
+
+	// Columns are placed on the grid of the graphics density, counted from the
+	// left paper edge, so consecutive payloads line up without seams
+	plan->scaleX = &scaleX;
+	plan->column = (Bitu)floor(curX*bitGraph.horizDens + 0.5);
+	plan->phase = plan->column % scaleX.period;
+	plan->base = (plan->column / scaleX.period) * scaleX.stride;
+
+	// Line feeds come in finer steps than the pin pitch, so the pins hang from
+	// the pixel row of the head. Each pin covers the rows up to the next one.
+	Real64 headY = curY;
+	if ((printRes > 7) && (verticalDot != 0)) //for ESC t
+		headY += (Real64)verticalDot/(Real64)bitGraph.vertDens;
+	Bitu y0 = (Bitu)(floor(headY*dpi + 0.5) + sheetTop);
+
+	plan->numBits = bitGraph.bytesColumn * 8;
+	for (Bitu b=0; b<plan->numBits; b++)
+	{
+		Bitu pin = b % scaleY.period;
+		Bitu top = y0 + (b / scaleY.period) * scaleY.stride + scaleY.offset[pin];
+		Bitu bottom = y0 + (b / scaleY.period) * scaleY.stride + scaleY.offset[pin+1];
+		if (bottom <= top) bottom = top + 1;
+		plan->yStart[b] = top < (Bitu)page->h ? top : page->h;
+		plan->yEnd[b] = bottom < (Bitu)page->h ? bottom : page->h;
+	}
+	plan->pixels = composeRows(plan->yStart[0], plan->yEnd[plan->numBits-1]);
+}
+
+Bitu Imagewriter::nextBitColumn(IWBitPlan* plan, Bitu* width)
+{
+	const IWDotScale* scale = plan->scaleX;
+	Bitu x = plan->base + scale->offset[plan->phase];
+	Bitu next = plan->base + scale->offset[plan->phase+1];
+	*width = next > x ? next - x : 1;
+
+	plan->column++;
+	if (++plan->phase == scale->period)
+	{
+		plan->phase = 0;
+		plan->base += scale->stride;
+	}
+	return x;
+}
+
+void Imagewriter::finishBitPlan(const IWBitPlan* plan)
+{
+	// Leave the head right after the last column
+	curX = (Real64)plan->column/(Real64)bitGraph.horizDens;
+}
+
+bool Imagewriter::bitPlanExtent(const IWBitPlan* plan, Bitu numCols, Bitu* x0, Bitu* x1)
+{
+	const IWDotScale* scale = plan->scaleX;
+	Bitu last = plan->column + numCols - 1;
+	*x0 = plan->base + scale->offset[plan->phase];
+	*x1 = (last / scale->period) * scale->stride + scale->offset[last % scale->period + 1];
+	if (*x1 <= *x0) *x1 = *x0 + 1;
+	return *x1 <= (Bitu)page->w && plan->yEnd[plan->numBits-1] < (Bitu)page->h;
+}
+
+void Imagewriter::fillBitColumn(const IWBitPlan* plan, const Bit8u* column, Bitu x, Bitu width)
+{
+	if (x >= (Bitu)page->w) return;
+	if (x + width > (Bitu)page->w) width = page->w - x;
+
+	fillBitRows(plan, column, plan->pixels + x, page->pitch, plan->yStart[0], width);
+}
+
+void Imagewriter::fillBitRows(const IWBitPlan* plan, const Bit8u* column, Bit8u* target, Bitu pitch, Bitu yOrigin, Bitu width)
+{
+	Bit8u ink = color|0x1F;
+
+	// Fill the rows of each run of set pins. The rows of neighbouring pins
+	// always touch, so runs are joined across byte boundaries too.
+	Bitu runFirst = 0, runLast = 0;
+	bool open = false;
+	for (Bitu i=0; i<bitGraph.bytesColumn; i++)
+	{
+		Bit8u v = column[i];
+		for (Bitu r=0; r<bitRuns[v].count; r++)
+		{
+			Bitu first = i*8 + bitRuns[v].start[r];
+			Bitu last = first + bitRuns[v].len[r] - 1;
+			if (open && first == runLast + 1)
+			{
+				runLast = last;
+				continue;
+			}
+			if (open)
+			{
+				for (Bitu y=plan->yStart[runFirst]; y<plan->yEnd[runLast]; y++)
+					orSpan(target + (y - yOrigin)*pitch, width, ink);
+			}
+			runFirst = first;
+			runLast = last;
+			open = true;
+		}
+	}
+	if (open)
+	{
+		for (Bitu y=plan->yStart[runFirst]; y<plan->yEnd[runLast]; y++)
+			orSpan(target + (y - yOrigin)*pitch, width, ink);
+	}
+}
+
+void Imagewriter::rasterBitColumns(const Bit8u* data, Bitu numCols)
+{
+	IWBitPlan plan;
+	planBitImage(&plan);
+
+	Bitu x0, x1;
+	bool fits = false;
+	if (numCols > 0)
+	{
+		fits = bitPlanExtent(&plan, numCols, &x0, &x1);
+		markInk(x0, plan.yStart[0], x1, plan.yEnd[plan.numBits-1]);
+	}
+	if (bitGraph.kernel && fits)
+	{
+		bitGraph.kernel(&plan, data, numCols, plan.pixels + x0, page->pitch, color|0x1F);
+		plan.column += numCols;
+	}
+	else
+	{
+		for (Bitu c=0; c<numCols; c++, data += bitGraph.bytesColumn)
+		{
+			Bitu width;
+			Bitu x = nextBitColumn(&plan, &width);
+			fillBitColumn(&plan, data, x, width);
+		}
+	}
+	finishBitPlan(&plan);
+}
+
+bool Imagewriter::stampCachedBlock(const Bit8u* data, Bitu numCols)
+{
+	if (numCols < IW_BLOCKCACHE_MIN)
+		return false;
+
+	IWBitPlan plan;
+	planBitImage(&plan);
+
+	// Blocks cut off by the page border are not cached
+	Bitu x0, x1;
+	Bitu y0 = plan.yStart[0];
+	Bitu y1 = plan.yEnd[plan.numBits-1];
+	if (!bitPlanExtent(&plan, numCols, &x0, &x1) || y1 <= y0)
+		return false;
+	markInk(x0, y0, x1, y1);
+
+	// Key: density, color, the sub-pixel phase of the first column on the
+	// pixel grid and the payload itself
+	Bitu payload = numCols * bitGraph.bytesColumn;
+	Bitu keyLen = 8 + payload;
+	if (keyLen > blockKeySize)
+	{
+		blockKeySize = keyLen;
+		blockKey = (Bit8u*)realloc(blockKey, blockKeySize);
+	}
+	blockKey[0] = bitGraph.horizDens & 0xff;
+	blockKey[1] = bitGraph.horizDens >> 8;
+	blockKey[2] = bitGraph.vertDens & 0xff;
+	blockKey[3] = bitGraph.vertDens >> 8;
+	blockKey[4] = bitGraph.bytesColumn;
+	blockKey[5] = color;
+	blockKey[6] = plan.phase & 0xff;
+	blockKey[7] = plan.phase >> 8;
+	memcpy(blockKey + 8, data, payload);
+
+	Bit32u hash = IWLineCache::hashKey(blockKey, keyLen);
+	const IWLineStrip* strip = blockCache->find(blockKey, keyLen, hash);
+	if (strip == NULL)
+	{
+		blockCache->misses++;
+		if (!blockCache->admit(hash))
+			return false;
+
+		// The block comes back: rasterize it once into a strip
+		IWLineStrip* added = blockCache->store(blockKey, keyLen, hash, 0, 0, x1 - x0, y1 - y0);
+		if (added == NULL)
+			return false;
+		if (bitGraph.kernel)
+		{
+			bitGraph.kernel(&plan, data, numCols, added->pixels, added->w, color|0x1F);
+			plan.column += numCols;
+		}
+		else
+		{
+			for (Bitu c=0; c<numCols; c++, data += bitGraph.bytesColumn)
+			{
+				Bitu width;
+				Bitu x = nextBitColumn(&plan, &width);
+				fillBitRows(&plan, data, added->pixels + (x - x0), added->w, y0, width);
+			}
+		}
+		strip = added;
+	}
+	else
+	{
+		blockCache->hits++;
+		plan.column += numCols;
+	}
+	finishBitPlan(&plan);
+
+	// Graphics only ever OR ink into the page, so the strip goes on top of
+	// whatever is there
+	for (Bitu y=0; y<strip->h; y++)
+	{
+		Bit8u* row = plan.pixels + y*page->pitch + x0;
+		const Bit8u* source = strip->pixels + y*strip->w;
+		for (Bitu x=0; x<strip->w; x++)
+			row[x] |= source[x];
+	}
+	return true;
+}
+
+void Imagewriter::repeatBitColumn(const Bit8u* column, Bitu count)
+{
+	IWBitPlan plan;
+	planBitImage(&plan);
+
+	// Neighbouring columns touch, so the repeats make up one wide span
+	Bitu width;
+	Bitu spanX = nextBitColumn(&plan, &width);
+	Bitu spanEnd = spanX + width;
+	for (Bitu c=1; c<count; c++)
+	{
+		Bitu x = nextBitColumn(&plan, &width);
+		if (x + width > spanEnd) spanEnd = x + width;
+	}
+	finishBitPlan(&plan);
+
+	markInk(spanX, plan.yStart[0], spanEnd, plan.yEnd[plan.numBits-1]);
+	fillBitColumn(&plan, column, spanX, spanEnd - spanX);
+}
+#endif // HAVE_FREETYPE
+
+void Imagewriter::formFeed()
+{
+#ifdef HAVE_FREETYPE
+	// Don't output blank pages
+	if (continuousFeed)
+	{
+		finishFeed();
+		newPage(false,true);
+	}
+	else
+		newPage(!isBlank(),true);
+	finishMultipage();
+#endif // HAVE_FREETYPE
+}
+
+#ifdef HAVE_FREETYPE
+static void findNextName(const char* front, const char* ext, char* fname)
+{
+	Bitu i = 1;
+	FILE *test = NULL;
+	do
+	{
+		if (s_output_prefix[0]) {
+#ifdef WIN32
+			snprintf(fname, 200, ".\\%s_%s%d%s", s_output_prefix, front, (int)i++, ext);
+#else
+			snprintf(fname, 200, "./%s_%s%d%s", s_output_prefix, front, (int)i++, ext);
+#endif
+		} else {
+#ifdef WIN32
+			snprintf(fname, 200, ".\\%s%d%s", front, (int)i++, ext);
+#else
+			snprintf(fname, 200, "./%s%d%s", front, (int)i++, ext);
+#endif
+		}
+		test = fopen(fname, "rb");
+		if (test != NULL)
+			fclose(test);
+	}
+	while (test != NULL);
+}
+
+void Imagewriter::followHead()
+{
+	if (!continuousFeed)
+		return;
+
+	// Reverse feed stops at the top of the window, the paper above is gone
+	Real64 head = floor(curY*dpi + 0.5) + sheetTop;
+	if (head < 0)
+	{
+		curY = (Real64)-sheetTop/dpi;
+		head = 0;
+	}
+
+	// Once the head gets near the bottom, everything above the reach goes out in one step
+	Bitu row = (Bitu)head;
+	Bitu maxStep = (page->h / IW_TILE_ROWS) * IW_TILE_ROWS;
+	while (row + feedAhead > (Bitu)page->h)
+	{
+		Bitu rows = row > reachRows ? ((row - reachRows) / IW_TILE_ROWS) * IW_TILE_ROWS : 0;
+		if (rows > maxStep) rows = maxStep;
+		if (rows == 0)
+			break;
+		scrollWindow(rows);
+		row -= rows;
+	}
+}
+
+void Imagewriter::scrollWindow(Bitu rows)
+{
+	mergeBand();
+	writeFeedRows(rows);
+
+	// The strips that went out go back to the pool for the rows coming in at the bottom
+	Bitu gone = rows / IW_TILE_ROWS;
+	for (Bitu i=0; i<gone; i++)
+	{
+		if (colorTiles[i] != NULL || colorSpill[i] >= 0)
+			numColorTiles--;
+		if (colorTiles[i] != NULL)
+		{
+			page->freeRows(colorTiles[i]);
+			numResidentColors--;
+		}
+		if (tiles[i] != NULL)
+		{
+			page->freeRows(tiles[i]);
+			numResidentTiles--;
+		}
+		else if (tileSpill[i] < 0)
+			continue;
+		numInkedTiles--;
+	}
+	memmove(tiles, tiles + gone, (numTiles - gone)*sizeof(Bit8u*));
+	memset(tiles + numTiles - gone, 0, gone*sizeof(Bit8u*));
+	memmove(colorTiles, colorTiles + gone, (numTiles - gone)*sizeof(Bit8u*));
+	memset(colorTiles + numTiles - gone, 0, gone*sizeof(Bit8u*));
+	rowScratchY = (Bitu)-1;
+	memmove(tileSpill, tileSpill + gone, (numTiles - gone)*sizeof(Bit64s));
+	memmove(colorSpill, colorSpill + gone, (numTiles - gone)*sizeof(Bit64s));
+	memmove(tileSaved, tileSaved + gone, (numTiles - gone)*sizeof(bool));
+	for (Bitu i=numTiles-gone; i<numTiles; i++)
+	{
+		tileSpill[i] = -1;
+		colorSpill[i] = -1;
+		tileSaved[i] = false;
+	}
+
+	windowTop += rows;
+	sheetTop -= rows;
+	if (inkBottom <= rows)
+	{
+		inkLeft = page->w;
+		inkTop = page->h;
+		inkRight = inkBottom = 0;
+	}
+	else
+	{
+		inkTop = inkTop > rows ? inkTop - rows : 0;
+		inkBottom -= rows;
+	}
+}
+
+void Imagewriter::writeFeedRows(Bitu rows)
+{
+	bool colorps = strcasecmp(output, "colorps") == 0;
+	bool ps = colorps || strcasecmp(output, "ps") == 0;
+	Bitu windowRows = numTiles * IW_TILE_ROWS;
+	Bitu paperW = (Bitu)(defaultPageWidth*72);
+	Bitu paperH = (Bitu)(defaultPageHeight*72);
+
+	if (feedFile == NULL)
+	{
+		char fname[200];
+		if (ps)
+			findNextName("page", ".ps", &fname[0]);
+		else
+			findNextName("page", ".bmp", &fname[0]);
+		feedFile = fopen(fname, "wb");
+		if (!feedFile)
+		{
+			//LOG(LOG_MISC,LOG_ERROR)("PRINTER: Can't open file %s for printer output", fname);
+			return;
+		}
+
+		s_output_page_num++;
+		if (s_status_callback) {
+			char msg[64];
+			snprintf(msg, sizeof(msg), "Outputting page %d", s_output_page_num);
+			s_status_callback(msg);
+		}
+
+		if (ps)
+		{
+			fprintf(feedFile, "%%!PS-Adobe-3.0\n");
+			fprintf(feedFile, "%%%%Pages: (atend)\n");
+			fprintf(feedFile, "%%%%BoundingBox: 0 0 %i %i\n", paperW, paperH);
+			fprintf(feedFile, "%%%%Creator: GSport Virtual Printer\n");
+			fprintf(feedFile, "%%%%DocumentData: %s\n", s_ps_binary ? "Binary" : "Clean7Bit");
+			fprintf(feedFile, "%%%%LanguageLevel: %i\n", s_ps_level3 ? 3 : 2);
+			fprintf(feedFile, "%%%%EndComments\n");
+			feedPages = 0;
+			feedSheetRows = page->h;
+		}
+		else
+		{
+			// The height is filled in by finishFeed(). Color may come in any time further down
+			// the paper, so the stream only goes out at 1 bit for a job known to be black only
+			feedBits = s_black_only && monoPage ? 1 : 8;
+			fwriteBMPHeader(feedFile, feedBits, 0);
+		}
+		feedLine = page->allocRows(page->w*3 > page->pitch ? page->w*3 : page->pitch);
+	}
+
+	if (!ps)
+	{
+		// Rows top-down. At 1 bit any color ink is thresholded like black ink
+		Bitu rowBytes = feedBits == 1 ? (monoPitch + 3) & ~3 : (page->w + 3) & ~3;
+		for (Bitu y=0; y<rows; y++)
+		{
+			bool white = y >= windowRows || isWhiteRow(y);
+			if (!white)
+				feedInkEnd = windowTop + y + 1;
+			if (feedBits == 8)
+				fwrite(white ? whiteRow : pageRow(y), 1, rowBytes, feedFile);
+			else
+			{
+				memset(feedLine, 0, rowBytes);
+				if (!white && monoPage && colorRow(y, false) == NULL)
+					memcpy(feedLine, packedRow(y), monoPitch);
+				else if (!white)
+					packRow(pageRow(y), page->w, feedLine);
+				fwrite(feedLine, 1, rowBytes, feedFile);
+			}
+		}
+		if (rows > 0)
+			passFeedSheets(windowTop + rows - 1);
+		return;
+	}
+
+	// PostScript pages are cut from the paper at the form feeds, or a form length after
+	// the last one. Each run of rows with ink on a sheet becomes an image placed at its rows
+	Real64 rowPoints = (Real64)paperH/page->h;
+	Bitu y = 0;
+	while (y < rows)
+	{
+		Bitu sheetStart;
+		Bitu sheetEnd = feedSheet(windowTop + y, &sheetStart);
+		Bitu sheetRow = windowTop + y - sheetStart;
+		Bitu sheetRows = sheetEnd - sheetStart;
+		Bitu n = rows - y < sheetEnd - (windowTop + y) ? rows - y : sheetEnd - (windowTop + y);
+		passFeedSheets(windowTop + y);
+		if (sheetRow == 0)
+		{
+			feedPages++;
+			fprintf(feedFile, "%%%%Page: %i %i\n", (int)feedPages, (int)feedPages);
+			if (sheetRows != page->h || sheetRows != feedSheetRows)
+			{
+				// A form of another length than the document's, or back to it: each such
+				// sheet sets its own size so that it still prints when taken out alone
+				feedSheetRows = sheetRows;
+				Bitu sheetH = (Bitu)(sheetRows*rowPoints + 0.5);
+				fprintf(feedFile, "%%%%PageBoundingBox: 0 0 %i %i\n", paperW, sheetH);
+				fprintf(feedFile, "%%%%BeginPageSetup\n");
+				fprintf(feedFile, "<< /PageSize [%i %i] >> setpagedevice\n", paperW, sheetH);
+				fprintf(feedFile, "%%%%EndPageSetup\n");
+			}
+		}
+
+		Bitu first = y, last = y + n;
+		while (first < last && (first >= windowRows || isWhiteRow(first))) first++;
+		while (last > first && (last-1 >= windowRows || isWhiteRow(last-1))) last--;
+		if (first < last)
+		{
+			feedInkEnd = windowTop + last;
+
+			Bitu top = sheetRow + first - y;
+			Bitu numRows = last - first;
+			IWPSImage kind = psImageKind(colorps, first, last);
+			fprintf(feedFile, "gsave\n");
+			fprintf(feedFile, "0 %.4f translate\n", (sheetRows - top - numRows)*rowPoints);
+			fprintf(feedFile, "%i %.4f scale\n", paperW, numRows*rowPoints);
+			fprintPSImage(feedFile, kind, numRows);
+
+			IWPSEncoder data(feedFile, psDeflate(), s_ps_binary);
+			for (Bitu r=first; r<last; r++)
+				encodePSRow(&data, kind, r, isWhiteRow(r), feedLine);
+			data.finish();
+			fprintf(feedFile, "grestore\n");
+		}
+
+		y += n;
+		if (sheetRow + n == sheetRows)
+			fprintf(feedFile, "showpage\n");
+	}
+}
+
+void Imagewriter::finishFeed()
+{
+	// The paper runs out to the end of the sheet the last printed row is on
+	Bitu end = feedInkEnd;
+	if (!isBlank() && windowTop + inkBottom > end)
+		end = windowTop + inkBottom;
+	if (end > 0 || feedFile != NULL)
+	{
+		if (end < windowTop)
+			end = windowTop;
+		if (end > 0)
+		{
+			Bitu top;
+			end = feedSheet(end - 1, &top);
+		}
+		if (end > windowTop)
+			writeFeedRows(end - windowTop);
+	}
+
+	if (feedFile != NULL)
+	{
+		if (strcasecmp(output, "ps") == 0 || strcasecmp(output, "colorps") == 0)
+		{
+			fprintf(feedFile, "%%%%Pages: %i\n", (int)feedPages);
+			fprintf(feedFile, "%%%%EOF\n");
+		}
+		else
+		{
+			fseek(feedFile, 0, SEEK_SET);
+			fwriteBMPHeader(feedFile, feedBits, -(Bit32s)end);
+		}
+		fclose(feedFile);
+		feedFile = NULL;
+		page->freeRows(feedLine);
+		feedLine = NULL;
+	}
+
+	// Fresh paper for the next job
+	bandRows = 0;
+	bandDirtyTop = bandDirtyEnd = 0;
+	inkLeft = page->w;
+	inkTop = page->h;
+	inkRight = inkBottom = 0;
+	clearPage();
+	windowTop = 0;
+	sheetTop = 0;
+	feedInkEnd = 0;
+	feedSheetTop = 0;
+	numFeedCuts = 0;
+}
+
+Bitu Imagewriter::formRows()
+{
+	Bitu rows = (Bitu)floor(pageHeight*dpi + 0.5);
+	return rows > 0 ? rows : 1;
+}
+
+Bitu Imagewriter::feedSheet(Bitu row, Bitu* top)
+{
+	Bitu start = feedSheetTop;
+	Bitu i = 0;
+	for (;;)
+	{
+		Bitu end = i < numFeedCuts ? feedCuts[i++] : start + formRows();
+		if (row < end)
+		{
+			*top = start;
+			return end;
+		}
+		start = end;
+	}
 }
 
-void Imagewriter::printBitGraph(Bit8u ch)
+void Imagewriter::passFeedSheets(Bitu row)
 {
-	bitGraph.column[bitGraph.readBytesColumn++] = ch;
-	bitGraph.remBytes--;
+	Bitu top;
+	feedSheet(row, &top);
+	feedSheetTop = top;
+	while (numFeedCuts > 0 && feedCuts[0] <= top)
+	{
+		numFeedCuts--;
+		memmove(feedCuts, feedCuts + 1, numFeedCuts*sizeof(Bitu));
+	}
+}
 
-	// Only print after reading a full column
-	if (bitGraph.readBytesColumn < bitGraph.bytesColumn)
+#ifdef HAVE_SDL
+void Imagewriter::previewPage()
+{
+	if (!SDL_WasInit(SDL_INIT_VIDEO) && SDL_InitSubSystem(SDL_INIT_VIDEO) < 0)
+	{
+		printf("Preview unavailable: %s\n", SDL_GetError());
+		s_preview_pages = false;
 		return;
-
-	Real64 oldY = curY;
-	SDL_LockSurface(page);
-
-	// When page dpi is greater than graphics dpi, the drawn pixels get "bigger"
-	Bitu pixsizeX=1; 
-	Bitu pixsizeY=1;
-	if(bitGraph.adjacent) {
-		pixsizeX = dpi/bitGraph.horizDens > 0? dpi/bitGraph.horizDens : 1;
-		if(dpi%bitGraph.horizDens && bitGraph.horizDens < dpi)
-		{
-			if(PIXX%(bitGraph.horizDens*8) || (PIXX == 0)) //Primative scaling function
-			{
-				pixsizeX++;
-			}
-		}
-		pixsizeY = dpi/bitGraph.vertDens > 0? dpi/bitGraph.vertDens : 1;
-		if(bitGraph.vertDens == 216)
-		{
-			if(PIXY%(bitGraph.vertDens*8) || (PIXY == 0)) //Primative scaling function
-			{
-				pixsizeY++;
-			}
-		}
 	}
-	if ((printRes > 7) && (verticalDot != 0)) //for ESC t
+
+	// Shrink by a whole factor to fit the screen. Each preview pixel shows the
+	// darkest page pixel it covers, so thin lines don't drop out.
+	Bitu scale = (page->h + IW_PREVIEW_HEIGHT-1) / IW_PREVIEW_HEIGHT;
+	if (scale == 0) scale = 1;
+	Bitu w = page->w / scale;
+	Bitu h = page->h / scale;
+	SDL_Surface* screen = SDL_SetVideoMode(w, h, 8, SDL_SWSURFACE);
+	if (screen == NULL)
 	{
-		curY += (Real64)verticalDot/(Real64)bitGraph.vertDens;
+		printf("Preview unavailable: %s\n", SDL_GetError());
+		s_preview_pages = false;
+		return;
 	}
-	// TODO figure this out for 360dpi mode in windows
 
-//	Bitu pixsizeX = dpi/bitGraph.horizDens > 0? dpi/bitGraph.horizDens : 1;
-//	Bitu pixsizeY = dpi/bitGraph.vertDens > 0? dpi/bitGraph.vertDens : 1;
+	SDL_Color colors[256];
+	for (Bitu i=0; i<256; i++)
+	{
+		colors[i].r = page->palette[i].r;
+		colors[i].g = page->palette[i].g;
+		colors[i].b = page->palette[i].b;
+	}
+	SDL_SetColors(screen, colors, 0, 256);
 
-	for (Bitu i=0; i<bitGraph.bytesColumn; i++) // for each byte
+	SDL_LockSurface(screen);
+	for (Bitu y=0; y<h; y++)
 	{
-		for (Bitu j=1; j<256; j<<=1) { // for each bit
-			if (bitGraph.column[i] & j) {
-				for (Bitu xx=0; xx<pixsizeX; xx++)
-					for (Bitu yy=0; yy<pixsizeY; yy++) {
-						if (((PIXX + xx) < page->w) && ((PIXY + yy) < page->h))
-							*((Bit8u*)page->pixels + (PIXX+xx) + (PIXY+yy)*page->pitch) |= (color|0x1F);
-					}
-			} // else white pixel
-			curY += (Real64)1/(Real64)bitGraph.vertDens; // TODO line wrap?
+		Bit8u* target = (Bit8u*)screen->pixels + y*screen->pitch;
+		memset(target, 0, w);
+		for (Bitu r=0; r<scale; r++)
+		{
+			const Bit8u* row = pageRow(y*scale + r);
+			for (Bitu x=0; x<w; x++)
+				for (Bitu c=0; c<scale; c++)
+					if ((row[x*scale + c] & 0x1F) > (target[x] & 0x1F))
+						target[x] = row[x*scale + c];
 		}
 	}
-	SDL_UnlockSurface(page);
+	SDL_UnlockSurface(screen);
 
-	curY = oldY;
-	bitGraph.readBytesColumn = 0;
-
-	// Advance to the left
-	curX += (Real64)1/(Real64)bitGraph.horizDens;
-}
-#endif // HAVE_SDL
-
-void Imagewriter::formFeed()
-{
-#ifdef HAVE_SDL
-	// Don't output blank pages
-	newPage(!isBlank(),true);
-	finishMultipage();
-#endif // HAVE_SDL
-}
+	char caption[64];
+	snprintf(caption, sizeof(caption), "ImageWriter page %d", s_output_page_num);
+	SDL_WM_SetCaption(caption, NULL);
+	SDL_Flip(screen);
 
-#ifdef HAVE_SDL
-static void findNextName(char* front, char* ext, char* fname)
-{
-	Bitu i = 1;
-	FILE *test = NULL;
-	do
+	// Until a key or mouse button is pressed or the window is closed
+	SDL_Event event;
+	while (SDL_WaitEvent(&event))
 	{
-		if (s_output_prefix[0]) {
-#ifdef WIN32
-			snprintf(fname, 200, ".\\%s_%s%d%s", s_output_prefix, front, (int)i++, ext);
-#else
-			snprintf(fname, 200, "./%s_%s%d%s", s_output_prefix, front, (int)i++, ext);
-#endif
-		} else {
-#ifdef WIN32
-			snprintf(fname, 200, ".\\%s%d%s", front, (int)i++, ext);
-#else
-			snprintf(fname, 200, "./%s%d%s", front, (int)i++, ext);
-#endif
+		if (event.type == SDL_KEYDOWN || event.type == SDL_MOUSEBUTTONDOWN)
+			break;
+		if (event.type == SDL_QUIT)
+		{
+			s_preview_pages = false;
+			break;
 		}
-		test = fopen(fname, "rb");
-		if (test != NULL)
-			fclose(test);
 	}
-	while (test != NULL);
 }
+#endif // HAVE_SDL
 
 void Imagewriter::outputPage() 
-{/*
-	SDL_Surface *screen;
-	screen = SDL_SetVideoMode(1024, 768, 16, SDL_DOUBLEBUF | SDL_RESIZABLE);
-if (screen == NULL) {
-	printf("Unable to set video mode: %s\n", SDL_GetError());
-}
-SDL_Surface *image;
-SDL_LockSurface(page);
-image = SDL_DisplayFormat(page);
-SDL_UnlockSurface(page);
-SDL_Rect src, dest;
- 
-src.x = 0;
-src.y = 0;
-src.w = image->w;
-src.h = image->h;
- 
-dest.x = 100;
-dest.y = 100;
-dest.w = image->w;
-dest.h = image->h;
- 
-SDL_BlitSurface(image, &src, screen, &dest);
-SDL_Flip(screen);
- 
-SDL_Delay(2000);
-SDL_FreeSurface(image);*/
+{
 	char fname[200];
 	s_output_page_num++;
+
+	// The encoders read the page strips
+	mergeBand();
+
 	if (s_status_callback) {
 		char msg[64];
 		snprintf(msg, sizeof(msg), "Outputting page %d", s_output_page_num);
 		s_status_callback(msg);
 	}
+#ifdef HAVE_SDL
+	if (s_preview_pages)
+		previewPage();
+#endif
 	if (strcasecmp(output, "printer") == 0)
 	{
 #if defined (WIN32)
@@ -1724,7 +3599,7 @@ SDL_FreeSurface(image);*/
 					//If user clicks cancel, show warning dialog and force all output to bitmaps as failsafe.
 					MessageBox(NULL,"You did not select a printer.\nAll output from this print job will be saved as bitmap files.",NULL,MB_ICONEXCLAMATION);
 					findNextName("page", ".bmp", &fname[0]);
-					SDL_SaveBMP(page, fname); //Save first page as bitmap.
+					savePageBMP(fname); //Save first page as bitmap.
 					outputHandle = printerDC;
 					printerDC = NULL;
 					ShowCursor(0);
@@ -1740,7 +3615,7 @@ SDL_FreeSurface(image);*/
 		if (!printerDC) //Fall thru for subsequent pages if printer dialog was cancelled.
 		{
 			findNextName("page", ".bmp", &fname[0]);
-			SDL_SaveBMP(page, fname); //Save remaining pages.
+			savePageBMP(fname); //Save remaining pages.
 			return;
 		}
 		Bit32u physW = GetDeviceCaps(printerDC, PHYSICALWIDTH);
@@ -1772,7 +3647,6 @@ SDL_FreeSurface(image);*/
 			StartDoc(printerDC, &docinfo);
 			multiPageCounter = 1;
 		}
-		SDL_LockSurface(page);
 		StartPage(printerDC);
         DWORD TotalSize;
         HGDIOBJ Prev;
@@ -1784,30 +3658,26 @@ SDL_FreeSurface(image);*/
         BitmapInfo->bmiHeader.biWidth = page->w;
         BitmapInfo->bmiHeader.biHeight = -page->h;
         BitmapInfo->bmiHeader.biPlanes = 1;
-        BitmapInfo->bmiHeader.biBitCount = page->format->BitsPerPixel;
+        BitmapInfo->bmiHeader.biBitCount = 8;
         BitmapInfo->bmiHeader.biCompression = BI_RGB;
-        BitmapInfo->bmiHeader.biSizeImage = page->h * page->pitch;
+        BitmapInfo->bmiHeader.biSizeImage = page->h * ((page->w+3)&~3);
         BitmapInfo->bmiHeader.biXPelsPerMeter = 0;
         BitmapInfo->bmiHeader.biYPelsPerMeter = 0;
-        BitmapInfo->bmiHeader.biClrUsed = page->format->palette->ncolors;
+        BitmapInfo->bmiHeader.biClrUsed = 256;
         BitmapInfo->bmiHeader.biClrImportant = 0;
-        if (page->format->palette) {
-          for (int I=0; I<page->format->palette->ncolors; I++) {
-            BitmapInfo->bmiColors[I].rgbRed =
-              (page->format->palette->colors+I)->r;
-            BitmapInfo->bmiColors[I].rgbGreen =
-              (page->format->palette->colors+I)->g;
-            BitmapInfo->bmiColors[I].rgbBlue =
-              (page->format->palette->colors+I)->b;
-          }
+        for (int I=0; I<256; I++) {
+          BitmapInfo->bmiColors[I].rgbRed = page->palette[I].r;
+          BitmapInfo->bmiColors[I].rgbGreen = page->palette[I].g;
+          BitmapInfo->bmiColors[I].rgbBlue = page->palette[I].b;
         }
         memHDC = CreateCompatibleDC(printerDC);
         if (memHDC) {
           bitmap = CreateDIBSection(memHDC, BitmapInfo, DIB_RGB_COLORS,
                                     (&Pixels), NULL, 0);
           if (bitmap) {
-            memcpy (Pixels, page->pixels,
-		    BitmapInfo->bmiHeader.biSizeImage);
+            // DIB rows are padded to 4 bytes only
+            for (int y=0; y<page->h; y++)
+              memcpy ((Bit8u*)Pixels + y*((page->w+3)&~3), pageRow(y), page->w);
             Prev = SelectObject (memHDC, bitmap);
 			StretchBlt(printerDC, 0, 0, physW, physH, memHDC, soffsetW, soffsetH, page->w, page->h, SRCCOPY);
             SelectObject (memHDC,Prev);
@@ -1815,7 +3685,6 @@ SDL_FreeSurface(image);*/
           }
         }
         free (BitmapInfo);
-		SDL_UnlockSurface(page);
 		EndPage(printerDC);
 
 		if (multipageOutput)
@@ -1837,7 +3706,7 @@ SDL_FreeSurface(image);*/
 			int fd = mkstemp(tmp_path);
 			if (fd >= 0) {
 				close(fd);
-				if (SDL_SaveBMP(page, tmp_path) == 0) {
+				if (savePageBMP(tmp_path)) {
 					char cmd[512];
 					int ret;
 					if (s_printer_name && s_printer_name[0])
@@ -1859,214 +3728,92 @@ SDL_FreeSurface(image);*/
 		}
 #endif
 	}
-#ifdef C_LIBPNG
+#ifdef HAVE_ZLIB
 	else if (strcasecmp(output, "png") == 0)
 	{
 		// Find a page that does not exists
 		findNextName("page", ".png", &fname[0]);
-	
-		png_structp png_ptr;
-		png_infop info_ptr;
-		png_bytep * row_pointers;
-		png_color palette[256];
-		Bitu i;
-
-		/* Open the actual file */
-		FILE * fp=fopen(fname,"wb");
+		FILE* fp = fopen(fname, "wb");
 		if (!fp) 
 		{
 			//LOG(LOG_MISC,LOG_ERROR)("PRINTER: Can't open file %s for printer output", fname);
 			return;
 		}
 
-		/* First try to alloacte the png structures */
-		png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL,NULL, NULL);
-		if (!png_ptr) return;
-		info_ptr = png_create_info_struct(png_ptr);
-		if (!info_ptr) {
-			png_destroy_write_struct(&png_ptr,(png_infopp)NULL);
-			return;
+		// Black and white pages keep 1 bit per pixel, with index 1 = black ink
+		bool bilevel = blackAndWhite(inkTop, inkBottom);
+		IWColor bw[2] = { page->palette[0], page->palette[COLOR_BLACK|0x1F] };
+		IWPNGWriter png(fp, page->w, page->h, bilevel ? 1 : 8, bilevel ? bw : page->palette, bilevel ? 2 : 256,
+			dpi, s_deflate_level, s_png_threads ? s_png_threads : IWPNGWriter::defaultThreads());
+		Bit8u* line = bilevel ? page->allocRows(monoPitch) : NULL;
+		for (Bitu y=0; y<(Bitu)page->h; y++)
+		{
+			if (y < inkTop || y >= inkBottom || isWhiteRow(y))
+				png.putRow(whiteRow);
+			else if (bilevel)
+				png.putRow(maskRow(y, line));
+			else
+				png.putRow(pageRow(y));
 		}
-
-		/* Finalize the initing of png library */
-		png_init_io(png_ptr, fp);
-		png_set_compression_level(png_ptr,Z_BEST_COMPRESSION);
-		
-		/* set other zlib parameters */
-		png_set_compression_mem_level(png_ptr, 8);
-		png_set_compression_strategy(png_ptr,Z_DEFAULT_STRATEGY);
-		png_set_compression_window_bits(png_ptr, 15);
-		png_set_compression_method(png_ptr, 8);
-		png_set_compression_buffer_size(png_ptr, 8192);
-
-		
-		png_set_IHDR(png_ptr, info_ptr, page->w, page->h,
-			8, PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE,
-			PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-		for (i=0;i<256;i++) 
-		{
-			palette[i].red = page->format->palette->colors[i].r;
-			palette[i].green = page->format->palette->colors[i].g;
-			palette[i].blue = page->format->palette->colors[i].b;
-		}
-		png_set_PLTE(png_ptr, info_ptr, palette,256);
-		png_set_packing(png_ptr);
-		SDL_LockSurface(page);
-
-		// Allocate an array of scanline pointers
-		row_pointers = (png_bytep*)malloc(page->h*sizeof(png_bytep));
-		for (i=0; i<page->h; i++) 
-			row_pointers[i] = ((Bit8u*)page->pixels+(i*page->pitch));
-	
-		// tell the png library what to encode.
-		png_set_rows(png_ptr, info_ptr, row_pointers);
-		
-		// Write image to file
-		png_write_png(png_ptr, info_ptr, 0, NULL);
-
-
-
-
-		SDL_UnlockSurface(page);
-		
-		/*close file*/
+		if (!png.finish())
+			printf("Printer: writing %s failed, the page is incomplete\n", fname);
+		page->freeRows(line);
 		fclose(fp);
-	
-		/*Destroy PNG structs*/
-		png_destroy_write_struct(&png_ptr, &info_ptr);
-		
-		/*clean up dynamically allocated RAM.*/
-		free(row_pointers);
 	}
-#endif
-	else if (strcasecmp(output, "colorps") == 0)
+	else if (strcasecmp(output, "pdf") == 0)
 	{
-		FILE* psfile = NULL;
-		
-		// Continue postscript file?
-		if (outputHandle != NULL)
-			psfile = (FILE*)outputHandle;
-
-		// Create new file?
-		if (psfile == NULL)
+		// Continue the document?
+		IWPDFWriter* pdf = (IWPDFWriter*)outputHandle;
+		if (pdf == NULL)
 		{
 			if (!multipageOutput)
-				findNextName("page", ".ps", &fname[0]);
+				findNextName("page", ".pdf", &fname[0]);
 			else
-				findNextName("doc", ".ps", &fname[0]);
+				findNextName("doc", ".pdf", &fname[0]);
 
-			psfile = fopen(fname, "wb");
-			if (!psfile) 
+			FILE* fp = fopen(fname, "wb");
+			if (!fp)
 			{
 				//LOG(LOG_MISC,LOG_ERROR)("PRINTER: Can't open file %s for printer output", fname);
 				return;
 			}
-
-			// Print header
-			fprintf(psfile, "%%!PS-Adobe-3.0\n");
-			fprintf(psfile, "%%%%Pages: (atend)\n");
-			fprintf(psfile, "%%%%BoundingBox: 0 0 %i %i\n", (Bit16u)(defaultPageWidth*72), (Bit16u)(defaultPageHeight*72));
-			fprintf(psfile, "%%%%Creator: GSport Virtual Printer\n");
-			fprintf(psfile, "%%%%DocumentData: Clean7Bit\n");
-			fprintf(psfile, "%%%%LanguageLevel: 2\n");
-			fprintf(psfile, "%%%%EndComments\n");
-			multiPageCounter = 1;
+			pdf = new IWPDFWriter(fp, s_deflate_level);
 		}
 
-		fprintf(psfile, "%%%%Page: %i %i\n", multiPageCounter, multiPageCounter);
-		fprintf(psfile, "%i %i scale\n", (Bit16u)(defaultPageWidth*72), (Bit16u)(defaultPageHeight*72));
-		fprintf(psfile, "%i %i 8 [%i 0 0 -%i 0 %i]\n", page->w, page->h, page->w, page->h, page->h);
-		fprintf(psfile, "currentfile\n");
-		fprintf(psfile, "/ASCII85Decode filter\n");
-		fprintf(psfile, "/RunLengthDecode filter\n");
-		fprintf(psfile, "false 3\n");
-		fprintf(psfile, "colorimage\n");
-
-		SDL_LockSurface(page);
-		Bit8u * templine;
-		templine = (Bit8u*) malloc(page->w*3);
-		Bit32u x = 0;
-		Bit32u numy = page->h;
-		Bit32u numx = page->w;
-		Bit32u numpix = page->w*3;
-		Bit32u pix = 0;
-		Bit32u currDot = 0;
-		Bit32u y = 0;
-		Bit32u plane = 0;
-		Bit8u r, g, b;
-		ASCII85BufferPos = ASCII85CurCol = 0;
-		for (y=0; y < numy;y++)
-		{
-			currDot = 0;
-			for (x = 0; x < numx; x++)
-			{
-				SDL_GetRGB(getxyPixel(x,y), page->format, &r, &g, &b);
-				templine[currDot] = ~r; currDot++;
-				templine[currDot] = ~g; currDot++;
-				templine[currDot] = ~b; currDot++;
-			}
-			// Compress data using RLE
-			pix = 0;
-			while (pix < numpix)
-			{
-			if ((pix < numpix-2) && (templine[pix] == templine[pix+1]) && (templine[pix] == templine[pix+2]))
-			{
-				// Found three or more pixels with the same color
-				Bit8u sameCount = 3;
-				Bit8u col = templine[pix];
-				while (sameCount < 128 && sameCount+pix < numpix && col == templine[pix+sameCount])
-					sameCount++;
-
-				fprintASCII85(psfile, 257-sameCount);
-				fprintASCII85(psfile, 255-col);
-
-				// Skip ahead
-				pix += sameCount;
-			}
+		// Black and white pages go to Group 4, with 1 = black ink like the PostScript mask
+		IWPDFImage kind = IW_PDF_INDEXED;
+		if (blackAndWhite(inkTop, inkBottom))
+			kind = IW_PDF_BILEVEL;
+		else if (s_gray_pdf)
+			kind = IW_PDF_GRAY;
+		pdf->beginPage(page->w, page->h, (Bitu)(defaultPageWidth*72), (Bitu)(defaultPageHeight*72), kind, page->palette);
+		Bit8u* line = kind == IW_PDF_BILEVEL ? page->allocRows(monoPitch) : NULL;
+		for (Bitu y=0; y<(Bitu)page->h; y++)
+		{
+			if (y < inkTop || y >= inkBottom || isWhiteRow(y))
+				pdf->putRow(whiteRow);
+			else if (kind == IW_PDF_BILEVEL)
+				pdf->putRow(maskRow(y, line));
 			else
-			{
-				// Find end of heterogenous area
-				Bit8u diffCount = 1;
-				while (diffCount < 128 && diffCount+pix < numpix && 
-					(
-						   (diffCount+pix < numpix-2)
-						|| (templine[pix+diffCount] != templine[pix+diffCount+1])
-						|| (templine[pix+diffCount] != templine[pix+diffCount+2])
-					))
-					diffCount++;
-
-				fprintASCII85(psfile, diffCount-1);
-				for (Bit8u i=0; i<diffCount; i++)
-					fprintASCII85(psfile, 255-templine[pix++]);
-			}
-			}
+				pdf->putRow(pageRow(y));
 		}
-		// Write EOD for RLE and ASCII85
-		fprintASCII85(psfile, 128);
-		fprintASCII85(psfile, 256);
-
-		SDL_UnlockSurface(page);
-		free(templine);
-
-		fprintf(psfile, "showpage\n");
+		pdf->endPage();
+		page->freeRows(line);
 
 		if (multipageOutput)
-		{
-			multiPageCounter++;
-			outputHandle = psfile;
-		}
+			outputHandle = pdf;
 		else
 		{
-			fprintf(psfile, "%%%%Pages: 1\n");
-			fprintf(psfile, "%%%%EOF\n");
-			fclose(psfile);
+			pdf->finish();
+			delete pdf;
 			outputHandle = NULL;
 		}
 	}
-	else if (strcasecmp(output, "ps") == 0)
+#endif
+	else if (strcasecmp(output, "ps") == 0 || strcasecmp(output, "colorps") == 0)
 	{
 		FILE* psfile = NULL;
-		printf("%d\n",getPixel(2));
+		IWPSImage kind = psImageKind(strcasecmp(output, "colorps") == 0, inkTop, inkBottom);
 		
 		// Continue postscript file?
 		if (outputHandle != NULL)
@@ -2090,69 +3837,25 @@ SDL_FreeSurface(image);*/
 			// Print header
 			fprintf(psfile, "%%!PS-Adobe-3.0\n");
 			fprintf(psfile, "%%%%Pages: (atend)\n");
-			fprintf(psfile, "%%%%BoundingBox: 0 0 %i %i\n", (Bit16u)(defaultPageWidth*72), (Bit16u)(defaultPageHeight*72));
+			fprintf(psfile, "%%%%BoundingBox: 0 0 %i %i\n", (Bitu)(defaultPageWidth*72), (Bitu)(defaultPageHeight*72));
 			fprintf(psfile, "%%%%Creator: GSport Virtual Printer\n");
-			fprintf(psfile, "%%%%DocumentData: Clean7Bit\n");
-			fprintf(psfile, "%%%%LanguageLevel: 2\n");
+			fprintf(psfile, "%%%%DocumentData: %s\n", s_ps_binary ? "Binary" : "Clean7Bit");
+			fprintf(psfile, "%%%%LanguageLevel: %i\n", s_ps_level3 ? 3 : 2);
 			fprintf(psfile, "%%%%EndComments\n");
 			multiPageCounter = 1;
 		}
 
 		fprintf(psfile, "%%%%Page: %i %i\n", multiPageCounter, multiPageCounter);
-		fprintf(psfile, "%i %i scale\n", (Bit16u)(defaultPageWidth*72), (Bit16u)(defaultPageHeight*72));
-		fprintf(psfile, "%i %i 8 [%i 0 0 -%i 0 %i]\n", page->w, page->h, page->w, page->h, page->h);
-		fprintf(psfile, "currentfile\n");
-		fprintf(psfile, "/ASCII85Decode filter\n");
-		fprintf(psfile, "/RunLengthDecode filter\n");
-		fprintf(psfile, "image\n");
-
-		SDL_LockSurface(page);
-
-		Bit32u pix = 0;
-		Bit32u numpix = page->h*page->w;
-		ASCII85BufferPos = ASCII85CurCol = 0;
+		fprintf(psfile, "%i %i scale\n", (Bitu)(defaultPageWidth*72), (Bitu)(defaultPageHeight*72));
+		fprintPSImage(psfile, kind, page->h);
 
-		while (pix < numpix)
-		{
-			// Compress data using RLE
-
-			if ((pix < numpix-2) && (getPixel(pix) == getPixel(pix+1)) && (getPixel(pix) == getPixel(pix+2)))
-			{
-				// Found three or more pixels with the same color
-				Bit8u sameCount = 3;
-				Bit8u col = getPixel(pix);
-				while (sameCount < 128 && sameCount+pix < numpix && col == getPixel(pix+sameCount))
-					sameCount++;
-
-				fprintASCII85(psfile, 257-sameCount);
-				fprintASCII85(psfile, 255-col);
-
-				// Skip ahead
-				pix += sameCount;
-			}
-			else
-			{
-				// Find end of heterogenous area
-				Bit8u diffCount = 1;
-				while (diffCount < 128 && diffCount+pix < numpix && 
-					(
-						   (diffCount+pix < numpix-2)
-						|| (getPixel(pix+diffCount) != getPixel(pix+diffCount+1))
-						|| (getPixel(pix+diffCount) != getPixel(pix+diffCount+2))
-					))
-					diffCount++;
-
-				fprintASCII85(psfile, diffCount-1);
-				for (Bit8u i=0; i<diffCount; i++)
-					fprintASCII85(psfile, 255-getPixel(pix++));
-			}
-		}
-
-		// Write EOD for RLE and ASCII85
-		fprintASCII85(psfile, 128);
-		fprintASCII85(psfile, 256);
-
-		SDL_UnlockSurface(page);
+		// Only the rows of the ink bounding box need converting, the rest is white
+		Bit8u* line = kind == IW_PS_RGB || kind == IW_PS_MASK ? page->allocRows(page->w*3) : NULL;
+		IWPSEncoder data(psfile, psDeflate(), s_ps_binary);
+		for (Bitu y=0; y<(Bitu)page->h; y++)
+			encodePSRow(&data, kind, y, y < inkTop || y >= inkBottom || isWhiteRow(y), line);
+		data.finish();
+		page->freeRows(line);
 
 		fprintf(psfile, "showpage\n");
 
@@ -2173,73 +3876,186 @@ SDL_FreeSurface(image);*/
 	{	
 		// Find a page that does not exists
 		findNextName("page", ".bmp", &fname[0]);
-		SDL_SaveBMP(page, fname);
+		savePageBMP(fname);
 	}
 }
 
-void Imagewriter::fprintASCII85(FILE* f, Bit16u b)
+// True if the eight pixels at p are all 0
+static inline bool blankPixels8(const Bit8u* p)
+{
+	Bit64u pixels;
+	memcpy(&pixels, p, sizeof(pixels));
+	return pixels == 0;
+}
+
+bool Imagewriter::blackAndWhite(Bitu top, Bitu bottom)
 {
-	if (b != 256)
+	if (bilevelPage())
+		return true;
+
+	// Palette entries that are neither paper white nor full black ink
+	bool shade[256];
+	for (Bitu i=0; i<256; i++)
 	{
-		if (b < 256)
-			ASCII85Buffer[ASCII85BufferPos++] = (Bit8u)b;
+		const IWColor& c = page->palette[i];
+		shade[i] = !(c.r == 255 && c.g == 255 && c.b == 255) && !(c.r == 0 && c.g == 0 && c.b == 0);
+	}
+	if (shade[COLOR_BLACK|0x1F])
+		return false;
 
-		if (ASCII85BufferPos == 4 || b == 257)
+	for (Bitu y=top; y<bottom; y++)
+	{
+		// Black only strips of a packed page are bits of full black
+		if (isWhiteRow(y) || (monoPage && colorRow(y, false) == NULL))
+			continue;
+		const Bit8u* row = pageRow(y);
+		Bitu x = 0;
+		while (x < (Bitu)page->w)
 		{
-			Bit32u num = (Bit32u)ASCII85Buffer[0] << 24 | (Bit32u)ASCII85Buffer[1] << 16 | (Bit32u)ASCII85Buffer[2] << 8 | (Bit32u)ASCII85Buffer[3];
-
-			// Deal with special case
-			if (num == 0 && b != 257)
+			if (x + 8 <= (Bitu)page->w && blankPixels8(&row[x]))
 			{
-				fprintf(f, "z");
-				if (++ASCII85CurCol >= 79)
-				{
-					ASCII85CurCol = 0;
-					fprintf(f, "\n");
-				}
+				x += 8;
+				continue;
 			}
-			else
-			{
-				char buffer[5];
-				for (Bit8s i=4; i>=0; i--)
-				{
-					buffer[i] = (Bit8u)((Bit32u)num % (Bit32u)85);
-					buffer[i] += 33;
-					num /= (Bit32u)85;
-				}
+			if (shade[row[x]])
+				return false;
+			x++;
+		}
+	}
+	return true;
+}
 
-				// Make sure a line never starts with a % (which may be mistaken as start of a comment)
-				if (ASCII85CurCol == 0 && buffer[0] == '%')
-					fprintf(f, " ");
-				
-				for (int i=0; i<((b != 257)?5:ASCII85BufferPos+1); i++)
-				{
-					fprintf(f, "%c", buffer[i]);
-					if (++ASCII85CurCol >= 79)
-					{
-						ASCII85CurCol = 0;
-						fprintf(f, "\n");
-					}
-				}
-			}
+const Bit8u* Imagewriter::maskRow(Bitu y, Bit8u* line)
+{
+	if (monoPage && colorRow(y, false) == NULL)
+		return packedRow(y);
+
+	// The page is black and white, so any pixel without red is black
+	const Bit8u* row = pageRow(y);
+	memset(line, 0, monoPitch);
+	Bitu x = 0;
+	while (x < (Bitu)page->w)
+	{
+		if ((x & 7) == 0 && x + 8 <= (Bitu)page->w && blankPixels8(&row[x]))
+		{
+			x += 8;
+			continue;
+		}
+		if (page->palette[row[x]].r == 0)
+			line[x>>3] |= 0x80>>(x&7);
+		x++;
+	}
+	return line;
+}
 
-			ASCII85BufferPos = 0;
+IWPSImage Imagewriter::psImageKind(bool color, Bitu top, Bitu bottom)
+{
+	// Pages of nothing but paper white and full black ink print as a stencil
+	if (blackAndWhite(top, bottom))
+		return IW_PS_MASK;
+	if (color)
+		return s_indexed_colorps ? IW_PS_INDEXED : IW_PS_RGB;
+	return IW_PS_GRAY;
+}
+
+void Imagewriter::fprintPSImage(FILE* f, IWPSImage kind, Bitu numRows)
+{
+	if (kind == IW_PS_INDEXED)
+	{
+		// The page palette as a lookup table, so the data stays at one byte per pixel
+		fprintf(f, "[/Indexed /DeviceRGB 255\n<");
+		for (Bitu i=0; i<256; i++)
+		{
+			fprintf(f, "%02X%02X%02X", page->palette[i].r, page->palette[i].g, page->palette[i].b);
+			if (i % 12 == 11)
+				fprintf(f, "\n");
 		}
+		fprintf(f, ">] setcolorspace\n");
+		fprintf(f, "<< /ImageType 1 /Width %i /Height %i /BitsPerComponent 8\n", page->w, (int)numRows);
+		fprintf(f, "/Decode [0 255] /ImageMatrix [%i 0 0 -%i 0 %i]\n", page->w, (int)numRows, (int)numRows);
+		fprintf(f, "/DataSource currentfile\n");
+		IWPSEncoder::fprintFilters(f, psDeflate(), s_ps_binary);
+		fprintf(f, ">>\n");
+		fprintf(f, "image\n");
+		return;
+	}
 
+	if (kind == IW_PS_MASK)
+	{
+		// Set bits paint in the current color
+		fprintf(f, "0 setgray\n");
+		fprintf(f, "%i %i true [%i 0 0 -%i 0 %i]\n", page->w, (int)numRows, page->w, (int)numRows, (int)numRows);
 	}
-	else // Close string
+	else
+		fprintf(f, "%i %i 8 [%i 0 0 -%i 0 %i]\n", page->w, (int)numRows, page->w, (int)numRows, (int)numRows);
+	fprintf(f, "currentfile\n");
+	IWPSEncoder::fprintFilters(f, psDeflate(), s_ps_binary);
+	if (kind == IW_PS_MASK)
+		fprintf(f, "imagemask\n");
+	else if (kind == IW_PS_RGB)
 	{
-		// Partial tupel if there are still bytes in the buffer
-		if (ASCII85BufferPos > 0)
-		{
-			for (Bit8u i = ASCII85BufferPos; i < 4; i++)
-				ASCII85Buffer[i] = 0;
+		fprintf(f, "false 3\n");
+		fprintf(f, "colorimage\n");
+	}
+	else
+		fprintf(f, "image\n");
+}
 
-			fprintASCII85(f, 257);
+void Imagewriter::encodePSRow(IWPSEncoder* data, IWPSImage kind, Bitu y, bool white, Bit8u* line)
+{
+	switch (kind)
+	{
+	case IW_PS_INDEXED:
+		// Palette indices as they are, 0 = white
+		if (white)
+			data->putRepeat(0, page->w);
+		else
+			data->putRow(pageRow(y), page->w);
+		break;
+	case IW_PS_RGB:
+		if (white)
+			data->putRepeat(0xFF, page->w*3);
+		else
+		{
+			if (monoPage && colorRow(y, false) == NULL)
+			{
+				// Black only strip of a packed page: straight from the bits
+				const Bit8u* packed = packedRow(y);
+				Bit8u r, g, b;
+				page->getRGB(COLOR_BLACK|0x1F, &r, &g, &b);
+				memset(line, 0xFF, page->w*3);
+				for (Bitu x=0; x<(Bitu)page->w; x++)
+				{
+					if (packed[x>>3] & (0x80>>(x&7)))
+					{
+						line[x*3] = r;
+						line[x*3+1] = g;
+						line[x*3+2] = b;
+					}
+				}
+			}
+			else
+			{
+				const Bit8u* row = pageRow(y);
+				for (Bitu x=0; x<(Bitu)page->w; x++)
+					page->getRGB(row[x], &line[x*3], &line[x*3+1], &line[x*3+2]);
+			}
+			data->putRow(line, page->w*3);
 		}
-
-		fprintf(f, "~");
-		fprintf(f, ">\n");
+		break;
+	case IW_PS_MASK:
+		// 1 = black ink
+		if (white)
+			data->putRepeat(0, monoPitch);
+		else
+			data->putRow(maskRow(y, line), monoPitch);
+		break;
+	default:
+		if (white)
+			data->putRepeat(0xFF, page->w);
+		else
+			data->putRow(pageRow(y), page->w, 0xFF);
+		break;
 	}
 }
 
@@ -2261,6 +4077,14 @@ void Imagewriter::finishMultipage()
 			fprintf(psfile, "%%%%EOF\n");
 			fclose(psfile);
 		}
+#ifdef HAVE_ZLIB
+		else if (strcasecmp(output, "pdf") == 0)
+		{
+			IWPDFWriter* pdf = (IWPDFWriter*)outputHandle;
+			pdf->finish();
+			delete pdf;
+		}
+#endif
 		else if (strcasecmp(output, "printer") == 0)
 		{
 #if defined (WIN32)
@@ -2273,14 +4097,13 @@ void Imagewriter::finishMultipage()
 
 bool Imagewriter::isBlank() {
 	bool blank = true;
-	SDL_LockSurface(page);
-
-	for (Bit16u y=0; y<page->h; y++)
-		for (Bit16u x=0; x<page->w; x++)
-			if (*((Bit8u*)page->pixels + x + (y*page->pitch)) != 0)
-				blank = false;
+	if (inkRight <= inkLeft)
+		return blank;
 
-	SDL_UnlockSurface(page);
+	// Strips only exist once something was printed on them (and on a packed page,
+	// survived the threshold)
+	mergeBand();
+	blank = numInkedTiles == 0;
 	return blank;
 }
 
@@ -2296,8 +4119,7 @@ Bit8u Imagewriter::getxyPixel(Bit32u x,Bit32u y) {
 	/* Set a pointer to the exact location in memory of the pixel
      in question: */
 
-	p = (Bit8u *) (((Bit8u *) page->pixels) +	/* Start at top of RAM */
-		 (y * page->pitch) +	/* Go down Y lines */
+	p = (Bit8u *) (pageRow(y) +	/* Start of row y */
 						x);		/* Go in X pixels */
 
 
@@ -2307,11 +4129,7 @@ Bit8u Imagewriter::getxyPixel(Bit32u x,Bit32u y) {
 
 	return (*p);
 }
-Bit8u Imagewriter::getPixel(Bit32u num) {
-	Bit32u pixel = *((Bit8u*)page->pixels + (num % page->w) + ((num / page->w) * page->pitch));
-	return *((Bit8u*)page->pixels + (num % page->w) + ((num / page->w) * page->pitch));
-}
-#endif // HAVE_SDL
+#endif // HAVE_FREETYPE
 
 //Interfaces to C code
 
@@ -2328,6 +4146,12 @@ extern "C" void imagewriter_loop(Bit8u pchar)
 	defaultImagewriter->printChar(pchar);
 }
 
+extern "C" void imagewriter_write(const Bit8u* buf, int len)
+{
+	if (defaultImagewriter == NULL || len <= 0) return;
+	defaultImagewriter->printString(buf, len);
+}
+
 extern "C" void imagewriter_close()
 {
 	delete defaultImagewriter;
@@ -2339,6 +4163,23 @@ extern "C" void imagewriter_feed()
 	defaultImagewriter->formFeed();
 }
 
+extern "C" unsigned long imagewriter_peak_memory()
+{
+	return (unsigned long)(s_peak_memory >> 10);
+}
+
+extern "C" int imagewriter_has_output(const char *output)
+{
+	// PNG and PDF pages are deflated
+#ifndef HAVE_ZLIB
+	if (strcasecmp(output, "png") == 0 || strcasecmp(output, "pdf") == 0)
+		return 0;
+#else
+	(void)output;
+#endif
+	return 1;
+}
+
 extern "C" void imagewriter_set_status_callback(void (*cb)(const char *msg))
 {
 	s_status_callback = cb;
@@ -2349,6 +4190,114 @@ extern "C" void imagewriter_set_printer_name(const char *name)
 	s_printer_name = name;
 }
 
+extern "C" int imagewriter_set_option(const char *option)
+{
+	// name=value, applied to printers created afterwards
+	const char* value = strchr(option, '=');
+	if (value == NULL)
+		return 0;
+	size_t nameLen = value++ - option;
+
+	if (nameLen == 4 && strncasecmp(option, "mono", nameLen) == 0)
+	{
+		if (strcasecmp(value, "auto") == 0) { s_mono_pages = true; s_black_only = false; }
+		else if (strcasecmp(value, "on") == 0) { s_mono_pages = true; s_black_only = true; }
+		else if (strcasecmp(value, "off") == 0) { s_mono_pages = false; s_black_only = false; }
+		else return 0;
+		return 1;
+	}
+#ifdef HAVE_SDL
+	if (nameLen == 7 && strncasecmp(option, "preview", nameLen) == 0)
+	{
+		if (strcasecmp(value, "on") == 0) s_preview_pages = true;
+		else if (strcasecmp(value, "off") == 0) s_preview_pages = false;
+		else return 0;
+		return 1;
+	}
+#endif
+	if (nameLen == 6 && strncasecmp(option, "budget", nameLen) == 0)
+	{
+		char* end;
+		long budget = strtol(value, &end, 10);
+		if (*value == '\0' || *end != '\0' || budget < 0 || budget > 1024*1024)
+			return 0;
+		s_page_budget = (Bitu)budget;
+		return 1;
+	}
+	if (nameLen == 4 && strncasecmp(option, "pool", nameLen) == 0)
+	{
+		char* end;
+		long pool = strtol(value, &end, 10);
+		if (*value == '\0' || *end != '\0' || pool < 0 || pool > 1024*1024)
+			return 0;
+		IWPageBuffer::setPoolBudget((Bit64u)pool << 20);
+		return 1;
+	}
+	if (nameLen == 7 && strncasecmp(option, "colorps", nameLen) == 0)
+	{
+		if (strcasecmp(value, "indexed") == 0) s_indexed_colorps = true;
+		else if (strcasecmp(value, "rgb") == 0) s_indexed_colorps = false;
+		else return 0;
+		return 1;
+	}
+#ifdef HAVE_ZLIB
+	if (nameLen == 7 && strncasecmp(option, "pslevel", nameLen) == 0)
+	{
+		if (strcmp(value, "3") == 0) s_ps_level3 = true;
+		else if (strcmp(value, "2") == 0) s_ps_level3 = false;
+		else return 0;
+		return 1;
+	}
+	if (nameLen == 7 && strncasecmp(option, "deflate", nameLen) == 0)
+	{
+		if (value[0] < '1' || value[0] > '9' || value[1] != '\0')
+			return 0;
+		s_deflate_level = value[0] - '0';
+		return 1;
+	}
+	if (nameLen == 7 && strncasecmp(option, "threads", nameLen) == 0)
+	{
+		char* end;
+		long threads = strtol(value, &end, 10);
+		if (*value == '\0' || *end != '\0' || threads < 0 || threads > IW_PNG_MAX_THREADS)
+			return 0;
+		s_png_threads = (Bitu)threads;
+		return 1;
+	}
+	if (nameLen == 3 && strncasecmp(option, "pdf", nameLen) == 0)
+	{
+		if (strcasecmp(value, "indexed") == 0) s_gray_pdf = false;
+		else if (strcasecmp(value, "gray") == 0) s_gray_pdf = true;
+		else return 0;
+		return 1;
+	}
+#endif
+	if (nameLen == 6 && strncasecmp(option, "psdata", nameLen) == 0)
+	{
+		if (strcasecmp(value, "ascii85") == 0) s_ps_binary = false;
+		else if (strcasecmp(value, "binary") == 0) s_ps_binary = true;
+		else return 0;
+		return 1;
+	}
+	if (nameLen == 4 && strncasecmp(option, "feed", nameLen) == 0)
+	{
+		if (strcasecmp(value, "continuous") == 0) s_continuous_feed = true;
+		else if (strcasecmp(value, "sheets") == 0) s_continuous_feed = false;
+		else return 0;
+		return 1;
+	}
+	if (nameLen == 5 && strncasecmp(option, "reach", nameLen) == 0)
+	{
+		char* end;
+		long reach = strtol(value, &end, 10);
+		if (*value == '\0' || *end != '\0' || reach < 0 || reach > 72*72)
+			return 0;
+		s_feed_reach = (int)reach;
+		return 1;
+	}
+	return 0;
+}
+
 extern "C" void imagewriter_set_output_prefix(const char *prefix)
 {
 	if (prefix && prefix[0]) {
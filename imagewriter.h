@@ -53,18 +53,12 @@
 #if !defined __IMAGEWRITER_H
 #define __IMAGEWRITER_H
 #ifdef __cplusplus
-#ifdef C_LIBPNG
-#include <png.h>
-#endif
-
 #include <stdio.h>
 
-#ifdef HAVE_SDL
-#include "SDL.h"
-
+#ifdef HAVE_FREETYPE
 #include <ft2build.h>
 #include FT_FREETYPE_H
-#endif // HAVE_SDL
+#endif // HAVE_FREETYPE
 
 #if defined (WIN32)
 #include <windows.h>
@@ -114,11 +108,68 @@ enum IWTypeface
 	prop = 1
 };
 
+// How a page goes into PostScript
+enum IWPSImage
+{
+	IW_PS_GRAY,							// 8-bit gray image
+	IW_PS_MASK,							// 1-bit imagemask of a black and white page
+	IW_PS_RGB,							// 24-bit colorimage
+	IW_PS_INDEXED						// 8-bit palette indices with an Indexed color space
+};
+
 typedef struct {
 	Bitu codepage;
 	const Bit16u* map;
 } IWCHARMAP;
 
+struct IWAtlasSize;
+struct IWColor;
+class IWLineCache;
+class IWPageBuffer;
+class IWPSEncoder;
+
+#ifdef HAVE_FREETYPE
+// Integer mapping of a dot grid onto page pixels for one density and the page dpi
+typedef struct {
+	Bit16u density;						// Dots per inch of the grid (0 = not set up)
+	Bitu period;						// The pattern of dot widths repeats every period dots...
+	Bitu stride;						// ...which are stride pixels wide
+	Bitu offset[321];					// First pixel of each dot in a period (period+1 entries)
+} IWDotScale;
+
+// Pixel geometry of a bit image at the current head position
+typedef struct {
+	const IWDotScale* scaleX;
+	Bitu column;						// Dot column of the head on the horizontal grid
+	Bitu phase, base;					// column % period and the first pixel of its period
+	Bitu numBits;						// Pins per column (8 or 24)
+	Bitu yStart[24], yEnd[24];			// Rows of each pin, clipped to the page
+	Bit8u* pixels;						// Page rows to compose into from row yStart[0] (see composeRows)
+} IWBitPlan;
+
+// Rasterizes complete bit image columns at a whole number of pixels per dot. target is row
+// plan->yStart[0] at the first column
+typedef void (*IWBitKernel)(const IWBitPlan* plan, const Bit8u* data, Bitu numCols, Bit8u* target, Bitu pitch, Bit8u ink);
+#endif // HAVE_FREETYPE
+
+#ifdef HAVE_FREETYPE
+// A rendered glyph, taken from the embedded atlas or from the current FreeType face
+typedef struct {
+	FT_Bitmap bitmap;
+	Bit32s left, top;					// Position of the bitmap relative to the pen (in pixels)
+	Bit32s advance;						// Horizontal advance (26.6)
+} IWGlyph;
+
+// A glyph of a text run, positioned on the page
+typedef struct {
+	IWGlyph glyph;
+	Bitu scratchOffset;					// Offset of a copied FreeType bitmap in runScratch, or -1
+	Bitu penX, penY;					// Top left of the bitmap on the page (wrapped around if left or above it)
+	Bit16u code;						// Unicode code point of the glyph
+	Bit8u userChar;						// Downloaded character to stamp instead of a glyph (0 = none)
+} IWRunGlyph;
+#endif // HAVE_FREETYPE
+
 
 class Imagewriter {
 public:
@@ -129,6 +180,9 @@ public:
 	// Process one character sent to virtual printer
 	void printChar(Bit8u ch);
 
+	// Process a block of data sent to virtual printer. Runs of text are rendered in one go
+	void printString(const Bit8u* buf, Bitu len);
+
 	// Hard Reset (like switching printer off and on)
 	void resetPrinterHard();
 
@@ -147,10 +201,13 @@ public:
 	// Manual formfeed
 	void formFeed();
 
-#ifdef HAVE_SDL
+#ifdef HAVE_FREETYPE
 	// Returns true if the current page is blank
 	bool isBlank();
-#endif // HAVE_SDL
+#endif // HAVE_FREETYPE
+
+	// The checks in tests/ drive the page store directly
+	friend class IWPageTest;
 
 private:
 
@@ -166,10 +223,10 @@ private:
 	// Output current page 
 	void outputPage();
 
-#ifdef HAVE_SDL
+#ifdef HAVE_FREETYPE
 	// used to fill the color "sub-pallettes"
 	void FillPalette(Bit8u redmax, Bit8u greenmax, Bit8u bluemax, Bit8u colorID,
-							SDL_Palette* pal);
+							IWColor* pal);
 
 	// Checks if given char belongs to a command and process it. If false, the character
 	// should be printed
@@ -178,39 +235,267 @@ private:
 	// Reload font. Must be called after changing dpi, style or cpi
 	void updateFont();
 
+	// Loads the FreeType face for the size chosen by updateFont(). Returns false if the font is unavailable
+	bool loadFace();
+
+	// Returns the file name of the font for the current typeface
+	const char* fontFileName();
+
+	// Gets the bitmap and metrics of a character, from the atlas if possible. Returns false if no font is available
+	bool getGlyph(Bit16u code, IWGlyph* glyph);
+
 	// Reconfigures printer parameters after changing soft-switches with ESC Z and ESC D
 	void updateSwitch();
-	
-	// Overprints a slash over zero if softswitch B-1 is set
-	void slashzero(Bit16u penX, Bit16u penY);
 
-	// Blits the given glyph on the page surface. If add is true, the values of bitmap are
-	// added to the values of the pixels in the page
-	void blitGlyph(FT_Bitmap bitmap, Bit16u destx, Bit16u desty, bool add);
+	// True if ch is printed rather than interpreted as a control code (outside of ESC sequences)
+	bool isPrintable(Bit8u ch);
+
+	// Prints a run of printable characters in one style: lays out all pen positions, wraps,
+	// then blits the glyphs into one composed band and draws score lines per line segment
+	void printRun(const Bit8u* run, Bitu len);
+
+	// Fills a run entry with a positioned glyph, copying FreeType bitmaps into runScratch
+	void addRunGlyph(IWRunGlyph* g, const IWGlyph* glyph, Bit16u code, Bitu penX, Bitu penY, Bitu& scratchUsed);
+
+	// Prints a glyph of a run (with the extra passes for bold) into a pixel buffer
+	void blitRunGlyph(Bit8u* pixels, Bitu w, Bitu h, Bitu pitch, const IWRunGlyph* g, Bitu x, Bitu y);
+
+	// Prints a laid out line segment from the line cache into rows returned by composeRows()
+	// for page row top, storing it if it repeats. Returns false if the glyphs have to be
+	// blitted one by one
+	bool stampCachedRun(Bit8u* pixels, Bitu top, IWRunGlyph* glyphs, Bitu numGlyphs, Bitu originX, Bitu originY);
+
+	// Blits the given glyph into a w x h pixel buffer (usually page rows). If add is
+	// true, the values of bitmap are added to the values of the pixels in the buffer
+	void blitGlyph(Bit8u* pixels, Bitu w, Bitu h, Bitu pitch, FT_Bitmap bitmap, Bitu destx, Bitu desty, bool add);
 
 	// Draws an anti-aliased line from (fromx, y) to (tox, y). If broken is true, gaps are included
 	void drawLine(Bitu fromx, Bitu tox, Bitu y, bool broken);
 
+	// Returns where to draw page rows top to bottom-1: row y starts at the returned
+	// pointer + (y-top)*page->pitch. Rows that fit in one head pass are composed in the
+	// band buffer, which is merged into the page when the head moves on
+	Bit8u* composeRows(Bitu top, Bitu bottom);
+
+	// Adds a rectangle (right and bottom exclusive) to the ink bounding box of the page
+	void markInk(Bitu left, Bitu top, Bitu right, Bitu bottom);
+
+	// Writes the rows composed in the band buffer back into the page
+	void mergeBand();
+
+	// Copies rows of the page as 8-bit pixels into dst (page->pitch bytes per row)
+	void readPageRows(Bitu top, Bitu rows, Bit8u* dst);
+
+	// Stores 8-bit rows into the page. A packed page keeps the black ink of at least half intensity
+	// and the ribbon colors
+	void writePageRows(Bitu top, Bitu rows, const Bit8u* src);
+
+	// Row y in the strip holding it, in the page format. Allocates a blank strip if alloc is set,
+	// else returns NULL for a white strip
+	Bit8u* tileRow(Bitu y, bool alloc);
+
+	// A buffer for strip keep, or for its color plane if color is set: leased from the pool
+	// within the memory budget, after spilling other strips with their planes to make room
+	Bit8u* takeTile(Bitu keep, bool color);
+
+	// Spills a strip in memory other than keep with its color plane and gives both back to
+	// the pool. False if there is none or spilling failed
+	bool dropTile(Bitu keep);
+
+	// The pool asking the printer at owner for memory, see IWPageBuffer::setReclaim()
+	static bool reclaimTile(void* owner);
+
+	// Writes strip i and its color plane to the spill file unless they are there already.
+	// False if that failed
+	bool spillTile(Bitu i);
+
+	// Brings spilled strip i and its color plane back into memory
+	void loadTile(Bitu i);
+
+	// 8-bit pixels of a page row, valid until the next call
+	const Bit8u* pageRow(Bitu y);
+
+	// Bits of a row of a packed page
+	const Bit8u* packedRow(Bitu y);
+
+	// Row y of the color plane of a packed page. Allocates the plane of the strip if alloc
+	// is set, else returns NULL while the strip has black ink only. Loads a spilled strip
+	Bit8u* colorRow(Bitu y, bool alloc);
+
+	// True if the page can go out at 1 bit per pixel: packed, and no strip took color ink
+	bool bilevelPage();
+
+	// True if nothing was printed on the strip of row y
+	bool isWhiteRow(Bitu y);
+
+	// Blanks the page, packed to 1 bit per pixel if enabled
+	void clearPage();
+
+#ifdef HAVE_SDL
+	// Shows the page in a window until a key is pressed
+	void previewPage();
+#endif // HAVE_SDL
+
+	// Saves the page as a BMP file (1 bit per pixel for a packed page). Returns false on failure
+	bool savePageBMP(const char* fname);
+
+	// Writes the BMP file header and palette for an image of the page width. A negative
+	// height means the rows follow top-down
+	void fwriteBMPHeader(FILE* f, Bitu bits, Bit32s height);
+
+	// On continuous feed, moves the page window down the paper until the head and what it
+	// prints next fit in, streaming out the rows above that reverse feed can no longer reach
+	void followHead();
+
+	// Streams out the top rows of the window (a multiple of IW_TILE_ROWS) and moves it down by them
+	void scrollWindow(Bitu rows);
+
+	// Encodes the top rows of the window into the feed stream, which is opened on the first
+	// call. Rows past the window are white
+	void writeFeedRows(Bitu rows);
+
+	// Runs the paper out to the end of the last printed sheet, closes the feed stream and
+	// blanks the window
+	void finishFeed();
+
+	// The programmed form length in rows
+	Bitu formRows();
+
+	// Finds the sheet of the feed stream that paper row is on. Sheets end at the form
+	// feeds recorded in feedCuts, the last one a form length after its top. Sets *top to
+	// the first row of the sheet and returns the row after it
+	Bitu feedSheet(Bitu row, Bitu* top);
+
+	// Moves feedSheetTop to the sheet of paper row once the rows before it are streamed out
+	void passFeedSheets(Bitu row);
+
 	// Setup the bitGraph structure
 	void setupBitImage(Bit8u dens, Bit16u numCols);
 
 	// Process a character that is part of bit image. Must be called iff bitGraph.remBytes > 0.
 	void printBitGraph(Bit8u ch);
 
+	// Process up to len bytes of bit image data, but no more than bitGraph.remBytes.
+	// Returns the number of bytes used
+	Bitu printBitGraph(const Bit8u* data, Bitu len);
+
+	// Rasterizes complete columns of bit image data at the print head and advances it
+	void rasterBitColumns(const Bit8u* data, Bitu numCols);
+
+	// Prints one dot column count times (ESC V / ESC U) as horizontal spans
+	void repeatBitColumn(const Bit8u* column, Bitu count);
+
+	// Builds the integer dot-to-pixel mapping of a density unless scale already holds it
+	void setupDotScale(IWDotScale* scale, Bit16u density);
+
+	// Works out the pin rows and the first dot column of the current bit image at the print head
+	void planBitImage(IWBitPlan* plan);
+
+	// Returns the first pixel column of the next dot column and its width in pixels
+	Bitu nextBitColumn(IWBitPlan* plan, Bitu* width);
+
+	// Moves the print head behind the columns handed out by nextBitColumn()
+	void finishBitPlan(const IWBitPlan* plan);
+
+	// Pixel columns x0 to x1-1 covered by the next numCols columns of a plan. Returns
+	// false if the page border cuts them off
+	bool bitPlanExtent(const IWBitPlan* plan, Bitu numCols, Bitu* x0, Bitu* x1);
+
+	// ORs the set pins of a dot column into the page over width pixel columns from x
+	void fillBitColumn(const IWBitPlan* plan, const Bit8u* column, Bitu x, Bitu width);
+
+	// Same for any 8-bit buffer; target points at the first pixel column in row yOrigin
+	void fillBitRows(const IWBitPlan* plan, const Bit8u* column, Bit8u* target, Bitu pitch, Bitu yOrigin, Bitu width);
+
+	// Prints a whole bit image block from the graphics cache, storing it if it repeats.
+	// Returns false if the columns have to be rasterized
+	bool stampCachedBlock(const Bit8u* data, Bitu numCols);
+
+	// Process a byte of an ESC I custom character download. Must be called iff udcState != 0.
+	void defineUserChar(Bit8u ch);
+
+	// Precomputes the pixel rectangles of a user-defined character at the current dot density
+	void renderUserChar(Bit8u slot);
+
+	// Makes sure the stamp of a user-defined character is current. Returns its horizontal advance (in inch)
+	Real64 prepareUserChar(Bit8u ch);
+
+	// Stamps a user-defined character into page rows returned by composeRows() for page row top
+	void stampUserChar(Bit8u* pixels, Bitu top, Bit8u ch, Bitu penX, Bitu penY);
+
 	// Copies the codepage mapping from the constant array to CurMap
 	void selectCodepage(Bit16u cp);
 
-	// Prints out a byte using ASCII85 encoding (only outputs something every four bytes). When b>255, closes the ASCII85 string
-	void fprintASCII85(FILE* f, Bit16u b);
-
-	// Returns value of the num-th pixel (couting left-right, top-down) in a safe way
-	Bit8u getPixel(Bit32u num);
 	Bit8u getxyPixel(Bit32u x,Bit32u y);
 
-	FT_Library FTlib;					// FreeType2 library used to render the characters
+	// True if rows top to bottom hold nothing but paper white and full black ink
+	bool blackAndWhite(Bitu top, Bitu bottom);
+
+	// Row y of a black and white page as bits, 1 = black ink. Packed rows are returned as they
+	// are, others are packed into line (monoPitch bytes)
+	const Bit8u* maskRow(Bitu y, Bit8u* line);
 
-	SDL_Surface* page;					// Surface representing the current page
-	FT_Face curFont;					// The font currently used to render characters
+	// PostScript image format of rows top to bottom for ps (color false) or colorps output
+	IWPSImage psImageKind(bool color, Bitu top, Bitu bottom);
+
+	// Prints the image operator for numRows rows of the page, reading the data from currentfile
+	void fprintPSImage(FILE* f, IWPSImage kind, Bitu numRows);
+
+	// Encodes row y of the page. line is scratch of page->w*3 bytes for IW_PS_RGB and IW_PS_MASK
+	void encodePSRow(IWPSEncoder* data, IWPSImage kind, Bitu y, bool white, Bit8u* line);
+
+	FT_Library FTlib;					// FreeType2 library used to render the characters
+	bool ftInitialized;					// FTlib is started by the first loadFace()
+
+	IWPageBuffer* page;					// Geometry and palette of the current page
+	Bit8u** tiles;						// Strips of IW_TILE_ROWS page rows, NULL while white or spilled
+	Bitu numTiles;
+	Bitu tileBytes;						// Size of a strip in the current page format
+	bool monoPage;						// Black ink is packed to 1 bit per pixel (MSB first, 1 = ink), ribbon colors go to colorTiles
+	Bitu monoPitch;						// Bytes per packed row
+	Bit8u** colorTiles;					// Color plane of each strip of a packed page (page pixels, 0 under black ink), NULL while black only or spilled
+	Bitu numColorTiles;					// Strips with a color plane, in memory or spilled
+	Bitu numResidentColors;				// Color planes in memory, counted against pageBudget with the strips
+	Bit8u* rowScratch;					// A packed row unpacked for pageRow()...
+	Bitu rowScratchY;					// ...which is kept until the page changes, -1 = none
+	Bit8u* packScratch;					// A row being packed for the page
+	Bit8u* whiteRow;					// page->pitch zero bytes, the rows of white strips
+	Bit8u* band;						// Page rows of the head pass being composed (page->pitch wide)
+	Bitu bandCapacity;					// Rows the band buffer can hold
+	Bitu bandTop, bandRows;				// Page rows held in the band (bandRows = 0: none)
+	Bitu bandDirtyTop, bandDirtyEnd;	// Rows drawn into since the band was loaded
+	Bitu inkLeft, inkTop;				// Bounding box of everything drawn since newPage(),
+	Bitu inkRight, inkBottom;			// empty while inkRight <= inkLeft
+	Bitu numInkedTiles;					// Strips of the page allocated so far
+	Bit64u pageBudget;					// Bytes of strips and color planes kept in memory before they spill, 0 = no limit
+	Bitu numResidentTiles;				// Strips in memory (tiles[i] != NULL)
+	Bitu pinnedTile;					// Strip takeTile() is allocating for, which the pool must not spill, numTiles = none
+	Bit64s* tileSpill;					// Offset of each strip in spillFile, -1 if never spilled
+	Bit64s* colorSpill;					// Offset of each color plane in spillFile, -1 if never spilled
+	bool* tileSaved;					// Strip and color plane in memory are unchanged since they were spilled or loaded
+	FILE* spillFile;					// Strips evicted over the budget, NULL until the first one
+	Bit64s spillEnd;					// End of the used part of spillFile
+	bool continuousFeed;				// Paper runs on without cuts, the page is a window streamed out at the top
+	Bitu windowTop;						// Paper rows streamed out above the window
+	Bits sheetTop;						// Window row of the top of the current sheet (negative once scrolled past)
+	Bitu reachRows;						// Rows above the head kept for reverse feed
+	Bitu feedAhead;						// Rows below the head kept for what it prints
+	Bitu feedInkEnd;					// Paper row after the last printed row streamed out
+	FILE* feedFile;						// Feed stream, NULL until the first rows are streamed
+	Bitu feedBits;						// Bits per pixel of a BMP feed stream
+	Bitu feedPages;						// PostScript pages begun in the feed stream
+	Bitu feedSheetTop;					// Paper row of the top of the sheet being streamed out
+	Bitu feedSheetRows;					// Length of the last PostScript sheet begun in the feed stream
+	Bitu* feedCuts;						// Paper rows of the form feeds after feedSheetTop, ascending
+	Bitu numFeedCuts, maxFeedCuts;
+	Bit8u* feedLine;					// Row being encoded into the feed stream
+	FT_Face curFont;					// The font currently used to render characters (NULL until a glyph needs it)
+	const char* fontFace;				// File name of the last face loaded
+	const IWAtlasSize* curAtlas;		// Embedded atlas matching the current font, or NULL
+	Bit16u fontHorizPoints, fontVertPoints;	// Character size chosen by updateFont() (in points)
+	bool fontItalic;					// Current font is slanted (italics or italic char table)
+	bool fontFailed;					// Loading the current face failed; not retried until the font changes
+	Bit32s fontAscender, fontHeight;	// Size metrics of the current font (26.6)
 	Bit8u color;
 	Bit8u switcha;						//Imagewriter softswitch A
 	Bit8u switchb;						//Imagewriter softswitch B
@@ -259,9 +544,36 @@ private:
 		Bit16u remBytes;				// Bytes left to read before image is done
 		Bit8u column[6];				// Bytes of the current and last column
 		Bit8u readBytesColumn;			// Bytes read so far for the current column
+		IWBitKernel kernel;				// Rasterizer specialized for the density, or NULL
 	} bitGraph;
 
 	Bit8u densk, densl, densy, densz;	// Image density modes used in ESC K/L/Y/Z commands
+	IWDotScale scaleX, scaleY;			// Dot-to-pixel mappings of the last bit image densities
+
+	struct userDefinedChar				// A character downloaded with ESC I
+	{
+		Bit8u width;					// Number of dot columns (0 = not defined)
+		Bit8u columns[16];				// Dot columns, bit 0 = top pin
+	} udc[96];
+
+	struct userCharStamp				// Pixel rectangles of a user-defined character at the current density
+	{
+		bool valid;
+		Bit8u numRects;
+		struct { Bit16u x, y, w, h; } rects[64];
+	} *udcStamps;
+
+	bool udcSelected;					// Custom character set selected with ESC '
+	Bit8u udcState;						// Parser state while reading ESC I definitions (see UDC_* constants)
+	Bit8u udcSlot, udcRead;				// Slot being defined and the number of columns its definition announced
+	Bit16u udcStampDpi;					// Dot density (dpi) the stamps were rendered for
+
+	Bit8u* runScratch;					// Copies of FreeType bitmaps for the text run being laid out
+	Bitu runScratchSize;
+	IWLineCache* lineCache;				// Strips of repeated text lines
+	IWLineCache* blockCache;			// Strips of repeated bit image blocks
+	Bit8u* blockKey;					// Key of the block being looked up
+	Bitu blockKeySize;
 
 	Bit16u curMap[256];					// Currently used ASCII => Unicode mapping
 	Bit16u charTables[4];				// Charactertables
@@ -281,17 +593,13 @@ private:
 #endif
 	int port;							// SCC Port
 
-#endif // HAVE_SDL
+#endif // HAVE_FREETYPE
 	Bit8u msb;							// MSB mode
 
 	char* output;						// Output method selected by user
 	void* outputHandle;					// If not null, additional pages will be appended to the given handle
 	bool multipageOutput;				// If true, all pages are combined to one file/print job etc. until the "eject page" button is pressed
 	Bit16u multiPageCounter;			// Current page (when printing multipages)
-
-	Bit8u ASCII85Buffer[4];				// Buffer used in ASCII85 encoding
-	Bit8u ASCII85BufferPos;				// Position in ASCII85 encode buffer
-	Bit8u ASCII85CurCol;				// Columns printed so far in the current lines
 };
 
 #endif
@@ -307,11 +615,15 @@ typedef unsigned char Bit8u;
 
 void imagewriter_init(int pdpi, int ppaper, int banner, char* poutput, bool mpage);
 void imagewriter_loop(Bit8u pchar);
+void imagewriter_write(const Bit8u* buf, int len);
 void imagewriter_close();
 void imagewriter_feed();
+unsigned long imagewriter_peak_memory();		// Most page memory the last closed printer held, in KB
+int imagewriter_has_output(const char *output);	// 0 if this build can't write the output type (png, pdf without zlib)
 void imagewriter_set_status_callback(void (*cb)(const char *msg));
 void imagewriter_set_printer_name(const char *name);
 void imagewriter_set_output_prefix(const char *prefix);
+int imagewriter_set_option(const char *option);
 #ifdef __cplusplus
 }
 #endif
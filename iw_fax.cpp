@@ -0,0 +1,225 @@
+#include "iw_fax.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct IWFaxCode {
+	Bit16u code;
+	Bit8u len;
+};
+
+// Run lengths 0-63 of white
+static const IWFaxCode whiteTerm[64] = {
+	{ 0x035,  8 }, { 0x007,  6 }, { 0x007,  4 }, { 0x008,  4 }, { 0x00B,  4 }, { 0x00C,  4 },
+	{ 0x00E,  4 }, { 0x00F,  4 }, { 0x013,  5 }, { 0x014,  5 }, { 0x007,  5 }, { 0x008,  5 },
+	{ 0x008,  6 }, { 0x003,  6 }, { 0x034,  6 }, { 0x035,  6 }, { 0x02A,  6 }, { 0x02B,  6 },
+	{ 0x027,  7 }, { 0x00C,  7 }, { 0x008,  7 }, { 0x017,  7 }, { 0x003,  7 }, { 0x004,  7 },
+	{ 0x028,  7 }, { 0x02B,  7 }, { 0x013,  7 }, { 0x024,  7 }, { 0x018,  7 }, { 0x002,  8 },
+	{ 0x003,  8 }, { 0x01A,  8 }, { 0x01B,  8 }, { 0x012,  8 }, { 0x013,  8 }, { 0x014,  8 },
+	{ 0x015,  8 }, { 0x016,  8 }, { 0x017,  8 }, { 0x028,  8 }, { 0x029,  8 }, { 0x02A,  8 },
+	{ 0x02B,  8 }, { 0x02C,  8 }, { 0x02D,  8 }, { 0x004,  8 }, { 0x005,  8 }, { 0x00A,  8 },
+	{ 0x00B,  8 }, { 0x052,  8 }, { 0x053,  8 }, { 0x054,  8 }, { 0x055,  8 }, { 0x024,  8 },
+	{ 0x025,  8 }, { 0x058,  8 }, { 0x059,  8 }, { 0x05A,  8 }, { 0x05B,  8 }, { 0x04A,  8 },
+	{ 0x04B,  8 }, { 0x032,  8 }, { 0x033,  8 }, { 0x034,  8 }
+};
+
+// Run lengths 64-2560 of white, in steps of 64
+static const IWFaxCode whiteMakeup[40] = {
+	{ 0x01B,  5 }, { 0x012,  5 }, { 0x017,  6 }, { 0x037,  7 }, { 0x036,  8 }, { 0x037,  8 },
+	{ 0x064,  8 }, { 0x065,  8 }, { 0x068,  8 }, { 0x067,  8 }, { 0x0CC,  9 }, { 0x0CD,  9 },
+	{ 0x0D2,  9 }, { 0x0D3,  9 }, { 0x0D4,  9 }, { 0x0D5,  9 }, { 0x0D6,  9 }, { 0x0D7,  9 },
+	{ 0x0D8,  9 }, { 0x0D9,  9 }, { 0x0DA,  9 }, { 0x0DB,  9 }, { 0x098,  9 }, { 0x099,  9 },
+	{ 0x09A,  9 }, { 0x018,  6 }, { 0x09B,  9 }, { 0x008, 11 }, { 0x00C, 11 }, { 0x00D, 11 },
+	{ 0x012, 12 }, { 0x013, 12 }, { 0x014, 12 }, { 0x015, 12 }, { 0x016, 12 }, { 0x017, 12 },
+	{ 0x01C, 12 }, { 0x01D, 12 }, { 0x01E, 12 }, { 0x01F, 12 }
+};
+
+// Run lengths 0-63 of black
+static const IWFaxCode blackTerm[64] = {
+	{ 0x037, 10 }, { 0x002,  3 }, { 0x003,  2 }, { 0x002,  2 }, { 0x003,  3 }, { 0x003,  4 },
+	{ 0x002,  4 }, { 0x003,  5 }, { 0x005,  6 }, { 0x004,  6 }, { 0x004,  7 }, { 0x005,  7 },
+	{ 0x007,  7 }, { 0x004,  8 }, { 0x007,  8 }, { 0x018,  9 }, { 0x017, 10 }, { 0x018, 10 },
+	{ 0x008, 10 }, { 0x067, 11 }, { 0x068, 11 }, { 0x06C, 11 }, { 0x037, 11 }, { 0x028, 11 },
+	{ 0x017, 11 }, { 0x018, 11 }, { 0x0CA, 12 }, { 0x0CB, 12 }, { 0x0CC, 12 }, { 0x0CD, 12 },
+	{ 0x068, 12 }, { 0x069, 12 }, { 0x06A, 12 }, { 0x06B, 12 }, { 0x0D2, 12 }, { 0x0D3, 12 },
+	{ 0x0D4, 12 }, { 0x0D5, 12 }, { 0x0D6, 12 }, { 0x0D7, 12 }, { 0x06C, 12 }, { 0x06D, 12 },
+	{ 0x0DA, 12 }, { 0x0DB, 12 }, { 0x054, 12 }, { 0x055, 12 }, { 0x056, 12 }, { 0x057, 12 },
+	{ 0x064, 12 }, { 0x065, 12 }, { 0x052, 12 }, { 0x053, 12 }, { 0x024, 12 }, { 0x037, 12 },
+	{ 0x038, 12 }, { 0x027, 12 }, { 0x028, 12 }, { 0x058, 12 }, { 0x059, 12 }, { 0x02B, 12 },
+	{ 0x02C, 12 }, { 0x05A, 12 }, { 0x066, 12 }, { 0x067, 12 }
+};
+
+// Run lengths 64-2560 of black, in steps of 64
+static const IWFaxCode blackMakeup[40] = {
+	{ 0x00F, 10 }, { 0x0C8, 12 }, { 0x0C9, 12 }, { 0x05B, 12 }, { 0x033, 12 }, { 0x034, 12 },
+	{ 0x035, 12 }, { 0x06C, 13 }, { 0x06D, 13 }, { 0x04A, 13 }, { 0x04B, 13 }, { 0x04C, 13 },
+	{ 0x04D, 13 }, { 0x072, 13 }, { 0x073, 13 }, { 0x074, 13 }, { 0x075, 13 }, { 0x076, 13 },
+	{ 0x077, 13 }, { 0x052, 13 }, { 0x053, 13 }, { 0x054, 13 }, { 0x055, 13 }, { 0x05A, 13 },
+	{ 0x05B, 13 }, { 0x064, 13 }, { 0x065, 13 }, { 0x008, 11 }, { 0x00C, 11 }, { 0x00D, 11 },
+	{ 0x012, 12 }, { 0x013, 12 }, { 0x014, 12 }, { 0x015, 12 }, { 0x016, 12 }, { 0x017, 12 },
+	{ 0x01C, 12 }, { 0x01D, 12 }, { 0x01E, 12 }, { 0x01F, 12 }
+};
+
+// Vertical mode codes for a1 - b1 = -3 to 3
+static const IWFaxCode verticalCodes[7] = {
+	{ 0x02, 7 }, { 0x02, 6 }, { 0x02, 3 }, { 0x01, 1 }, { 0x03, 3 }, { 0x03, 6 }, { 0x03, 7 }
+};
+
+// Lists the pixels whose color differs from the one before, the first pixel
+// having white to its left, and ends the list with three entries of w
+static void findChanges(const Bit8u* bits, Bitu w, Bitu* changes)
+{
+	Bitu n = 0;
+	Bitu x = 0;
+	Bit8u same = 0x00;					// A byte of the current color
+	while (x < w)
+	{
+		if ((x & 7) == 0)
+		{
+			Bitu i = x >> 3;
+			while (x + 8 <= w && bits[i] == same)
+			{
+				x += 8;
+				i++;
+			}
+			if (x >= w)
+				break;
+		}
+		Bit8u pixel = (bits[x>>3] & (0x80>>(x&7))) ? 0xFF : 0x00;
+		if (pixel != same)
+		{
+			changes[n++] = x;
+			same = pixel;
+		}
+		x++;
+	}
+	changes[n] = changes[n+1] = changes[n+2] = w;
+}
+
+IWFaxEncoder::IWFaxEncoder(FILE* f, Bitu w)
+{
+	this->f = f;
+	this->w = w;
+	refChanges = (Bitu*)malloc((w+3) * sizeof(Bitu));
+	curChanges = (Bitu*)malloc((w+3) * sizeof(Bitu));
+	bitBuffer = 0;
+	bitCount = 0;
+	outLen = 0;
+	finished = false;
+
+	// The row above the first one is white
+	if (refChanges != NULL)
+		refChanges[0] = refChanges[1] = refChanges[2] = w;
+}
+
+IWFaxEncoder::~IWFaxEncoder()
+{
+	if (!finished)
+		finish();
+	free(refChanges);
+	free(curChanges);
+}
+
+void IWFaxEncoder::flush()
+{
+	if (outLen > 0)
+		fwrite(out, 1, outLen, f);
+	outLen = 0;
+}
+
+void IWFaxEncoder::putCode(Bitu code, Bitu len)
+{
+	bitBuffer = (bitBuffer << len) | code;
+	bitCount += len;
+	while (bitCount >= 8)
+	{
+		bitCount -= 8;
+		if (outLen == IW_FAX_BUFFER)
+			flush();
+		out[outLen++] = (Bit8u)(bitBuffer >> bitCount);
+	}
+}
+
+void IWFaxEncoder::putRun(Bitu run, bool black)
+{
+	const IWFaxCode* term = black ? blackTerm : whiteTerm;
+	const IWFaxCode* makeup = black ? blackMakeup : whiteMakeup;
+	while (run >= 2560 + 64)
+	{
+		putCode(makeup[39].code, makeup[39].len);
+		run -= 2560;
+	}
+	if (run >= 64)
+	{
+		putCode(makeup[run/64 - 1].code, makeup[run/64 - 1].len);
+		run &= 63;
+	}
+	putCode(term[run].code, term[run].len);
+}
+
+void IWFaxEncoder::putRow(const Bit8u* bits)
+{
+	if (refChanges == NULL || curChanges == NULL)
+		return;
+	findChanges(bits, w, curChanges);
+
+	// a0 starts on an imaginary white pixel left of the row
+	Bits a0 = -1;
+	bool black = false;
+	Bitu ia = 0, ib = 0;
+	for (;;)
+	{
+		// a1 is the next change on this row. b1 the next change on the row above to the
+		// other color than a0's, b2 the one after it. Changes at even positions in the
+		// lists turn black
+		while ((Bits)curChanges[ia] <= a0)
+			ia++;
+		while (ib > 0 && (Bits)refChanges[ib-1] > a0)
+			ib--;
+		while ((Bits)refChanges[ib] <= a0)
+			ib++;
+		if (((ib & 1) != 0) != black)
+			ib++;
+		Bitu a1 = curChanges[ia];
+		Bitu b1 = refChanges[ib];
+		Bitu b2 = refChanges[ib+1];
+
+		if (b2 < a1)
+		{
+			// The run above ends before this one changes
+			putCode(0x1, 4);				// Pass mode
+			a0 = b2;
+		}
+		else if (a1 + 3 >= b1 && b1 + 3 >= a1)
+		{
+			putCode(verticalCodes[a1 + 3 - b1].code, verticalCodes[a1 + 3 - b1].len);
+			a0 = a1;
+			black = !black;
+		}
+		else
+		{
+			// Both runs up to a2 spelled out
+			Bitu a2 = curChanges[ia+1];
+			putCode(0x1, 3);				// Horizontal mode
+			putRun(a1 - (a0 < 0 ? 0 : a0), black);
+			putRun(a2 - a1, !black);
+			a0 = a2;
+		}
+		if (a0 >= (Bits)w)
+			break;
+	}
+
+	Bitu* swap = refChanges;
+	refChanges = curChanges;
+	curChanges = swap;
+}
+
+void IWFaxEncoder::finish()
+{
+	// EOFB, then the last byte filled up with zeros
+	putCode(0x1, 12);
+	putCode(0x1, 12);
+	if (bitCount > 0)
+		putCode(0, 8 - bitCount);
+	flush();
+	finished = true;
+}
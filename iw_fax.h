@@ -0,0 +1,50 @@
+/*
+ * CCITT Group 4 (T.6) encoder for black and white pages.
+ *
+ * Every row is coded against the row above it: where the edges of the ink
+ * line up within three pixels only a short vertical mode code is written,
+ * so text and line art shrink to a fraction of what Flate makes of the same
+ * bits. The first row is coded against an imaginary white row, and the data
+ * ends with an EOFB, as CCITTFaxDecode with /K -1 expects.
+ *
+ * A row is turned into the list of pixel positions where the color changes
+ * first; the coder then walks the change lists of the row and the one above
+ * instead of single pixels. White bytes are skipped whole.
+ */
+#ifndef IW_FAX_H
+#define IW_FAX_H
+
+#include "imagewriter.h"
+#include <stdio.h>
+
+#define IW_FAX_BUFFER           65536		// Bytes of code collected before writing
+
+class IWFaxEncoder {
+public:
+	// Starts the data of an image w pixels wide
+	IWFaxEncoder(FILE* f, Bitu w);
+	~IWFaxEncoder();
+
+	// Encodes the next row of (w+7)/8 bytes, the leftmost pixel in the high bit, 1 = black
+	void putRow(const Bit8u* bits);
+
+	// Ends the data and flushes the buffer
+	void finish();
+
+private:
+	void putCode(Bitu code, Bitu len);
+	void putRun(Bitu run, bool black);
+	void flush();
+
+	FILE* f;
+	Bitu w;
+	Bitu* refChanges;					// Changing pixels of the row above, w terminated
+	Bitu* curChanges;					// Changing pixels of the row being coded
+	Bit32u bitBuffer;					// Code bits not yet making a byte
+	Bitu bitCount;
+	Bit8u out[IW_FAX_BUFFER];
+	Bitu outLen;
+	bool finished;
+};
+
+#endif
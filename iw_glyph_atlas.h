@@ -0,0 +1,73 @@
+/*
+ * Pre-rasterized glyph atlas for the bundled printer font.
+ *
+ * iw_mkatlas renders letgothl.ttf at build time for the common dpi/cpi/style
+ * combinations and writes iw_glyph_atlas_data.cpp. When the current font
+ * parameters match one of the embedded sizes, the emulator blits these bitmaps
+ * directly and never has to load the face into FreeType. Anything else (other
+ * fonts, italics, multipoint, unusual sizes) falls back to FreeType.
+ */
+#ifndef IW_GLYPH_ATLAS_H
+#define IW_GLYPH_ATLAS_H
+
+#include "imagewriter.h"
+
+struct IWAtlasGlyph {
+	Bit16u code;						// Unicode code point
+	Bit16s left, top;					// bitmap_left / bitmap_top of the FreeType glyph slot
+	Bit16u width, rows;					// Bitmap size in pixels (pitch == width)
+	Bit32s advance;						// Horizontal advance (26.6)
+	Bit32u offset;						// Offset of the coverage bytes in IWAtlasSize::pixels
+};
+
+struct IWAtlasSize {
+	Bit16u dpi;
+	Bit16u horizPoints, vertPoints;		// Whole points, as passed to FT_Set_Char_Size
+	Bit32s ascender, height;			// size->metrics of the face (26.6)
+	Bit16u numGlyphs;
+	const IWAtlasGlyph* glyphs;			// Sorted by code
+	const Bit8u* pixels;				// 8-bit coverage, FT_RENDER_MODE_NORMAL
+};
+
+extern const char iwAtlasFontName[];	// File name of the font the atlas was built from
+extern const IWAtlasSize iwAtlasSizes[];
+extern const Bitu iwAtlasNumSizes;
+
+// Character size in points and effective cpi for a (non-multipoint) style/cpi
+// combination. Shared by updateFont() and iw_mkatlas so the atlas keys match.
+static inline void iw_font_points(Bit16u style, Real64 cpi, Real64* actcpi, Real64* horizPoints, Real64* vertPoints)
+{
+	*horizPoints = 10;
+	*vertPoints = 10;
+	*actcpi = cpi;
+
+	if (!(style & STYLE_CONDENSED)) {
+		*horizPoints *= 10.0/cpi;
+		//*vertPoints *= 10.0/cpi;
+	}
+
+	if (!(style & STYLE_PROP)) {
+		if ((cpi == 10.0) && (style & STYLE_CONDENSED)) {
+			*actcpi = 17.14;
+			*horizPoints *= 10.0/17.14;
+		}
+		if ((cpi == 12.0) && (style & STYLE_CONDENSED)) {
+			*actcpi = 20.0;
+			*horizPoints *= 10.0/20.0;
+			*vertPoints *= 10.0/12.0;
+		}
+	} else if (style & STYLE_CONDENSED) *horizPoints /= 2.0;
+
+	if ((style & STYLE_DOUBLEWIDTH)) {
+		*actcpi /= 2.0;
+		*horizPoints *= 2.0;
+	}
+
+	if (style & STYLE_SUPERSCRIPT || style & STYLE_SUBSCRIPT || style & STYLE_HALFHEIGHT) {
+		//*horizPoints *= 2.0/3.0;
+		*vertPoints *= 2.0/3.0;
+		//*actcpi /= 2.0/3.0;
+	}
+}
+
+#endif
@@ -0,0 +1,85 @@
+#include "iw_linecache.h"
+#include <stdlib.h>
+#include <string.h>
+
+IWLineCache::IWLineCache()
+{
+	memset(entries, 0, sizeof(entries));
+	memset(seen, 0, sizeof(seen));
+	hits = misses = stores = 0;
+}
+
+IWLineCache::~IWLineCache()
+{
+	clear();
+}
+
+void IWLineCache::clear()
+{
+	for (Bitu i=0; i<IW_LINECACHE_ENTRIES; i++)
+	{
+		free(entries[i].key);
+		free(entries[i].pixels);
+	}
+	memset(entries, 0, sizeof(entries));
+	memset(seen, 0, sizeof(seen));
+}
+
+Bit32u IWLineCache::hashKey(const Bit8u* key, Bitu keyLen)
+{
+	// FNV-1a
+	Bit32u hash = 2166136261u;
+	for (Bitu i=0; i<keyLen; i++)
+	{
+		hash ^= key[i];
+		hash *= 16777619u;
+	}
+	// Spread the last bytes over the low bits used to pick a slot
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	return hash ? hash : 1;
+}
+
+const IWLineStrip* IWLineCache::find(const Bit8u* key, Bitu keyLen, Bit32u hash)
+{
+	const IWLineStrip* strip = &entries[hash & (IW_LINECACHE_ENTRIES-1)];
+	if (strip->hash == hash && strip->keyLen == keyLen && !memcmp(strip->key, key, keyLen))
+		return strip;
+	return NULL;
+}
+
+bool IWLineCache::admit(Bit32u hash)
+{
+	Bit32u* slot = &seen[hash & (IW_LINECACHE_SEEN-1)];
+	if (*slot == hash)
+		return true;
+	*slot = hash;
+	return false;
+}
+
+IWLineStrip* IWLineCache::store(const Bit8u* key, Bitu keyLen, Bit32u hash, Bit16s x, Bit16s y, Bit16u w, Bit16u h)
+{
+	IWLineStrip* strip = &entries[hash & (IW_LINECACHE_ENTRIES-1)];
+	free(strip->key);
+	free(strip->pixels);
+
+	strip->key = (Bit8u*)malloc(keyLen);
+	strip->pixels = (Bit8u*)calloc((Bitu)w*h, 1);
+	if (strip->key == NULL || strip->pixels == NULL)
+	{
+		free(strip->key);
+		free(strip->pixels);
+		memset(strip, 0, sizeof(*strip));
+		return NULL;
+	}
+	memcpy(strip->key, key, keyLen);
+	strip->hash = hash;
+	strip->keyLen = keyLen;
+	strip->x = x;
+	strip->y = y;
+	strip->w = w;
+	strip->h = h;
+	stores++;
+	return strip;
+}
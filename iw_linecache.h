@@ -0,0 +1,61 @@
+/*
+ * Raster cache for repeated text lines and bit image blocks.
+ *
+ * Forms and reports print the same header, footer and column captions on
+ * every page. printRun() describes each laid out line segment by a key (font,
+ * bold, color and the glyph codes with their pixel offsets from the segment
+ * origin, which captures the sub-pixel x phase of the start position) and
+ * stores the rendered strip on the second sighting. Later occurrences are
+ * copied into the page row by row instead of blitting every glyph again.
+ *
+ * Letterheads and logos sent as bit images get the same treatment: a second
+ * instance keys whole graphics blocks by density, color, the sub-pixel phase
+ * of the first column and the payload bytes.
+ */
+#ifndef IW_LINECACHE_H
+#define IW_LINECACHE_H
+
+#include "imagewriter.h"
+
+#define IW_LINECACHE_ENTRIES    64		// Direct-mapped, must be a power of two
+#define IW_LINECACHE_SEEN       4096		// Hashes remembered for admission, power of two
+
+struct IWLineStrip {
+	Bit32u hash;						// Hash of the key, 0 = empty slot
+	Bitu keyLen;
+	Bit8u* key;
+	Bit16s x, y;						// Top left of the strip relative to the segment origin
+	Bit16u w, h;
+	Bit8u* pixels;						// w*h page pixels as rendered on a blank page
+};
+
+class IWLineCache {
+public:
+	IWLineCache();
+	~IWLineCache();
+
+	// Drops all strips. The counters are kept
+	void clear();
+
+	// Hash of a key, never 0
+	static Bit32u hashKey(const Bit8u* key, Bitu keyLen);
+
+	// Returns the strip stored for key, or NULL
+	const IWLineStrip* find(const Bit8u* key, Bitu keyLen, Bit32u hash);
+
+	// True if the key was missed before, i.e. the strip repeats and is worth storing
+	bool admit(Bit32u hash);
+
+	// Replaces the slot of key with a blank strip of the given size and returns it for rendering
+	IWLineStrip* store(const Bit8u* key, Bitu keyLen, Bit32u hash, Bit16s x, Bit16s y, Bit16u w, Bit16u h);
+
+	Bitu hits;							// Strips stamped from the cache
+	Bitu misses;						// Lookups that had to render
+	Bitu stores;						// Strips rendered into the cache
+
+private:
+	IWLineStrip entries[IW_LINECACHE_ENTRIES];
+	Bit32u seen[IW_LINECACHE_SEEN];
+};
+
+#endif
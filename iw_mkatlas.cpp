@@ -0,0 +1,115 @@
+/*
+ * iw_mkatlas - build-time generator for the embedded glyph atlas.
+ *
+ * Usage: iw_mkatlas font.ttf > iw_glyph_atlas_data.cpp
+ *
+ * Rasterizes the font exactly the way Imagewriter::updateFont() and
+ * printChar() do (FT_Set_Char_Size with whole points, FT_LOAD_DEFAULT,
+ * FT_RENDER_MODE_NORMAL) for 144/288 dpi and 9, 10, 12, 13.4, 15 and 17 cpi,
+ * plain, condensed and half-height. Bold is printed by overstriking the
+ * regular glyph, so it shares the regular bitmaps. The character set covers
+ * the Apple II map and the international substitutions.
+ */
+#include "iw_glyph_atlas.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <set>
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#include "iw_charmaps.h"
+
+static const Bit16u atlasDpi[] = { 144, 288 };
+static const Real64 atlasCpi[] = { 9.0, 10.0, 12.0, 13.4, 15.0, 17.0 };
+static const Bit16u atlasStyles[] = { 0, STYLE_CONDENSED, STYLE_HALFHEIGHT, STYLE_CONDENSED | STYLE_HALFHEIGHT };
+
+struct AtlasKey {
+	Bit16u dpi, horiz, vert;
+	bool operator<(const AtlasKey& o) const {
+		if (dpi != o.dpi) return dpi < o.dpi;
+		if (horiz != o.horiz) return horiz < o.horiz;
+		return vert < o.vert;
+	}
+};
+
+int main(int argc, char* argv[])
+{
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s font.ttf > iw_glyph_atlas_data.cpp\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	FT_Library lib;
+	FT_Face face;
+	if (FT_Init_FreeType(&lib) || FT_New_Face(lib, argv[1], 0, &face)) {
+		fprintf(stderr, "Unable to load font %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	// Every size the emulator can select for the listed combinations
+	std::set<AtlasKey> keys;
+	for (size_t d = 0; d < sizeof(atlasDpi)/sizeof(atlasDpi[0]); d++)
+		for (size_t c = 0; c < sizeof(atlasCpi)/sizeof(atlasCpi[0]); c++)
+			for (size_t s = 0; s < sizeof(atlasStyles)/sizeof(atlasStyles[0]); s++) {
+				Real64 actcpi, horizPoints, vertPoints;
+				iw_font_points(atlasStyles[s], atlasCpi[c], &actcpi, &horizPoints, &vertPoints);
+				AtlasKey k = { atlasDpi[d], (Bit16u)horizPoints, (Bit16u)vertPoints };
+				keys.insert(k);
+			}
+
+	std::set<Bit16u> codes;
+	for (int i = 1; i < 256; i++)
+		codes.insert(apple2Map[i]);
+	for (int i = 0; i < 8; i++)
+		for (int j = 0; j < 10; j++)
+			codes.insert(intCharSets[i][j]);
+
+	const char* base = strrchr(argv[1], '/');
+	base = base ? base + 1 : argv[1];
+
+	printf("// Generated by iw_mkatlas from %s - do not edit\n", base);
+	printf("#include \"iw_glyph_atlas.h\"\n\n");
+	printf("const char iwAtlasFontName[] = \"%s\";\n\n", base);
+
+	int n = 0;
+	for (std::set<AtlasKey>::const_iterator k = keys.begin(); k != keys.end(); ++k, n++) {
+		FT_Set_Char_Size(face, k->horiz*64, k->vert*64, k->dpi, k->dpi);
+
+		std::vector<Bit8u> pixels;
+		printf("static const IWAtlasGlyph glyphs%d[] = {\n", n);
+		for (std::set<Bit16u>::const_iterator c = codes.begin(); c != codes.end(); ++c) {
+			FT_Load_Glyph(face, FT_Get_Char_Index(face, *c), FT_LOAD_DEFAULT);
+			FT_Render_Glyph(face->glyph, FT_RENDER_MODE_NORMAL);
+			FT_Bitmap* bm = &face->glyph->bitmap;
+			printf("\t{0x%04x, %d, %d, %u, %u, %ld, %lu},\n", *c,
+				face->glyph->bitmap_left, face->glyph->bitmap_top,
+				(unsigned)bm->width, (unsigned)bm->rows,
+				(long)face->glyph->advance.x, (unsigned long)pixels.size());
+			for (unsigned y = 0; y < bm->rows; y++)
+				pixels.insert(pixels.end(), bm->buffer + y*bm->pitch, bm->buffer + y*bm->pitch + bm->width);
+		}
+		printf("};\n");
+
+		printf("static const Bit8u pixels%d[] = {", n);
+		for (size_t i = 0; i < pixels.size(); i++)
+			printf("%s%u,", (i % 32) ? "" : "\n\t", pixels[i]);
+		printf("\n\t0\n};\n\n");
+	}
+
+	printf("const IWAtlasSize iwAtlasSizes[] = {\n");
+	n = 0;
+	for (std::set<AtlasKey>::const_iterator k = keys.begin(); k != keys.end(); ++k, n++) {
+		FT_Set_Char_Size(face, k->horiz*64, k->vert*64, k->dpi, k->dpi);
+		printf("\t{%u, %u, %u, %ld, %ld, %u, glyphs%d, pixels%d},\n", k->dpi, k->horiz, k->vert,
+			(long)face->size->metrics.ascender, (long)face->size->metrics.height,
+			(unsigned)codes.size(), n, n);
+	}
+	printf("};\n");
+	printf("const Bitu iwAtlasNumSizes = %d;\n", n);
+
+	FT_Done_Face(face);
+	FT_Done_FreeType(lib);
+	return EXIT_SUCCESS;
+}
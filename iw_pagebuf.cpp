@@ -0,0 +1,174 @@
+#include "iw_pagebuf.h"
+#include <stdlib.h>
+#include <string.h>
+#if defined (WIN32)
+#include <malloc.h>
+#endif
+
+// Every block starts with a header of one IW_PAGE_ALIGN unit, which keeps the rows aligned
+struct IWBlock {
+	Bitu bytes;							// Size of the rows
+	IWBlock* next;						// Next free block of the pool
+};
+
+static IWBlock* s_freeBlocks = NULL;	// Blocks given back, for the next page asking for their size
+static Bit64u s_poolHeld = 0;			// Bytes of all blocks, handed out or free
+static Bit64u s_poolSpare = 0;			// Bytes of the blocks on the free list
+static Bit64u s_poolBudget = 0;
+static Bitu s_numPages = 0;
+static IWPageBuffer* s_pages = NULL;	// Page buffers to reclaim rows from
+
+static void releaseBlock(IWBlock* block)
+{
+	s_poolHeld -= block->bytes + IW_PAGE_ALIGN;
+#if defined (WIN32)
+	_aligned_free(block);
+#else
+	free(block);
+#endif
+}
+
+IWPageBuffer::IWPageBuffer(Bitu w, Bitu h)
+{
+	this->w = w;
+	this->h = h;
+	pitch = (w + IW_PAGE_ALIGN-1) & ~(Bitu)(IW_PAGE_ALIGN-1);
+	memset(palette, 0xFF, sizeof(palette));
+	used = peak = 0;
+	reclaim = NULL;
+	reclaimOwner = NULL;
+	nextPage = s_pages;
+	s_pages = this;
+	s_numPages++;
+}
+
+IWPageBuffer::~IWPageBuffer()
+{
+	IWPageBuffer** link = &s_pages;
+	while (*link != this)
+		link = &(*link)->nextPage;
+	*link = nextPage;
+
+	// The last page out empties the pool
+	if (--s_numPages == 0)
+	{
+		while (s_freeBlocks != NULL)
+		{
+			IWBlock* block = s_freeBlocks;
+			s_freeBlocks = block->next;
+			releaseBlock(block);
+		}
+		s_poolSpare = 0;
+	}
+}
+
+void IWPageBuffer::setPoolBudget(Bit64u bytes)
+{
+	s_poolBudget = bytes;
+}
+
+Bit64u IWPageBuffer::poolHeld()
+{
+	return s_poolHeld;
+}
+
+void IWPageBuffer::setReclaim(bool (*reclaim)(void* owner), void* owner)
+{
+	this->reclaim = reclaim;
+	reclaimOwner = owner;
+}
+
+bool IWPageBuffer::reclaimRows()
+{
+	for (IWPageBuffer* p = s_pages; p != NULL; p = p->nextPage)
+		if (p->reclaim != NULL && p->reclaim(p->reclaimOwner))
+			return true;
+	return false;
+}
+
+Bit8u* IWPageBuffer::takeBlock(Bitu bytes, bool force)
+{
+	IWBlock* block = NULL;
+
+	// A block of the same size that was given back
+	for (IWBlock** link = &s_freeBlocks; *link != NULL; link = &(*link)->next)
+	{
+		if ((*link)->bytes == bytes)
+		{
+			block = *link;
+			*link = block->next;
+			s_poolSpare -= block->bytes + IW_PAGE_ALIGN;
+			break;
+		}
+	}
+
+	if (block == NULL)
+	{
+		// Free blocks of other sizes make room for a new one. A block that must be granted
+		// then has the pages spill strips for it, and only goes over the budget once none can.
+		Bit64u size = (Bit64u)bytes + IW_PAGE_ALIGN;
+		while (s_poolBudget != 0 && s_poolHeld + size > s_poolBudget)
+		{
+			if (s_freeBlocks != NULL)
+			{
+				IWBlock* spare = s_freeBlocks;
+				s_freeBlocks = spare->next;
+				s_poolSpare -= spare->bytes + IW_PAGE_ALIGN;
+				releaseBlock(spare);
+			}
+			else if (!force)
+				return NULL;
+			else if (!reclaimRows())
+				break;
+		}
+
+		void* mem;
+#if defined (WIN32)
+		mem = _aligned_malloc((size_t)size, IW_PAGE_ALIGN);
+#else
+		if (posix_memalign(&mem, IW_PAGE_ALIGN, (size_t)size) != 0)
+			mem = NULL;
+#endif
+		if (mem == NULL)
+			return NULL;
+		block = (IWBlock*)mem;
+		block->bytes = bytes;
+		s_poolHeld += size;
+	}
+
+	used += bytes;
+	if (used > peak) peak = used;
+	return (Bit8u*)block + IW_PAGE_ALIGN;
+}
+
+Bit8u* IWPageBuffer::allocRows(Bitu bytes)
+{
+	Bit8u* rows = takeBlock(bytes, true);
+	if (rows != NULL)
+		memset(rows, 0, bytes);
+	return rows;
+}
+
+Bit8u* IWPageBuffer::leaseRows(Bitu bytes)
+{
+	return takeBlock(bytes, false);
+}
+
+void IWPageBuffer::freeRows(Bit8u* rows)
+{
+	if (rows == NULL)
+		return;
+	IWBlock* block = (IWBlock*)(rows - IW_PAGE_ALIGN);
+	used -= block->bytes;
+
+	// Blocks granted over the budget, or past what is worth keeping, go back to the system
+	Bit64u size = (Bit64u)block->bytes + IW_PAGE_ALIGN;
+	if ((s_poolBudget != 0 && s_poolHeld > s_poolBudget) || s_poolSpare + size > IW_POOL_SPARE)
+	{
+		releaseBlock(block);
+		return;
+	}
+	block->next = s_freeBlocks;
+	s_freeBlocks = block;
+	s_poolSpare += size;
+}
@@ -0,0 +1,89 @@
+/*
+ * Headless page buffer.
+ *
+ * Holds the geometry and the palette of the page the emulator renders into.
+ * The pixels themselves live in strips of rows owned by the printer, which
+ * allocates them here so every row starts on an IW_PAGE_ALIGN boundary and
+ * the pitch is a whole number of vector registers. No display library is
+ * needed; SDL is only used to preview pages when built with HAVE_SDL.
+ *
+ * All page buffers of the process share one pool of row blocks. Blocks a
+ * page gives back are handed to the next page asking for the same size, and
+ * with a pool budget set, leases that would take the pool over it are refused
+ * so the printer spills strips to disk instead of growing. Blocks that must be
+ * granted (the band, scratch rows, encoder lines) count against the budget as
+ * well: before one goes over it, the pool asks the pages to spill strips and
+ * give them back, and only grants it over the budget when no page has a strip
+ * left to give. Pages are never made to wait for memory. What is given back
+ * is only kept up to IW_POOL_SPARE bytes, and never over the budget, so the
+ * pool shrinks again after a large job. Each page buffer counts the bytes it
+ * holds, which gives the peak memory of a job.
+ *
+ * The pool is not locked: printers are driven from one thread, like the
+ * FreeType state they share.
+ */
+#ifndef IW_PAGEBUF_H
+#define IW_PAGEBUF_H
+
+#include "imagewriter.h"
+
+#define IW_PAGE_ALIGN           32		// Row alignment and pitch granularity in bytes, power of two
+#define IW_POOL_SPARE           (32<<20)	// Most bytes of given back blocks the pool keeps for the next page
+
+struct IWColor {
+	Bit8u r, g, b;
+};
+
+class IWPageBuffer {
+public:
+	// An 8-bit palettized page of w x h pixels, with an all white palette
+	IWPageBuffer(Bitu w, Bitu h);
+	~IWPageBuffer();
+
+	// Color of a pixel value
+	void getRGB(Bit8u pixel, Bit8u* r, Bit8u* g, Bit8u* b) const {
+		*r = palette[pixel].r;
+		*g = palette[pixel].g;
+		*b = palette[pixel].b;
+	}
+
+	// Blank memory for rows of the page, aligned to IW_PAGE_ALIGN. Over the pool budget the
+	// pages are asked to give strips back first, then it is granted anyway; NULL only if out
+	// of memory
+	Bit8u* allocRows(Bitu bytes);
+
+	// Like allocRows(), but the contents are undefined and NULL if the block would take
+	// the pool over its budget
+	Bit8u* leaseRows(Bitu bytes);
+
+	// Gives rows back to the pool. NULL is ignored
+	void freeRows(Bit8u* rows);
+
+	// Lets the pool ask the owner of the page for memory: reclaim(owner) spills rows and gives
+	// them back with freeRows(), or returns false if it has nothing left to give. NULL = never
+	void setReclaim(bool (*reclaim)(void* owner), void* owner);
+
+	// Bytes all page buffers together may hold, 0 = no limit
+	static void setPoolBudget(Bit64u bytes);
+
+	// Bytes the pool holds, handed out or kept for reuse
+	static Bit64u poolHeld();
+
+	Bitu w, h;							// Size in pixels
+	Bitu pitch;							// Bytes per row, a multiple of IW_PAGE_ALIGN
+	IWColor palette[256];
+	Bit64u used;						// Bytes of rows this page holds
+	Bit64u peak;						// Most bytes it held at once
+
+private:
+	Bit8u* takeBlock(Bitu bytes, bool force);
+
+	// Asks the pages in turn to give back rows, false if none could
+	static bool reclaimRows();
+
+	bool (*reclaim)(void* owner);		// See setReclaim()
+	void* reclaimOwner;
+	IWPageBuffer* nextPage;				// All page buffers of the pool, s_pages first
+};
+
+#endif
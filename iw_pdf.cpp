@@ -0,0 +1,214 @@
+#include "iw_pdf.h"
+#include "iw_pagebuf.h"
+#include "iw_psencode.h"
+#include "iw_fax.h"
+#include <stdlib.h>
+#include <string.h>
+
+IWPDFWriter::IWPDFWriter(FILE* f, int level)
+{
+	this->f = f;
+	this->level = level < 1 ? 1 : (level > 9 ? 9 : level);
+	pageObjects = NULL;
+	numPages = 0;
+	maxPages = 0;
+	flate = NULL;
+	fax = NULL;
+	failed = false;
+	finished = false;
+
+	// The catalog and the page tree get their numbers now and are written at the end
+	numObjects = 2;
+	maxObjects = 64;
+	offsets = (long*)malloc(maxObjects * sizeof(long));
+	if (offsets == NULL)
+		failed = true;
+
+	// The comment with high bytes marks the file as binary for transfer programs
+	fprintf(f, "%%PDF-1.4\n%%\xE2\xE3\xCF\xD3\n");
+}
+
+IWPDFWriter::~IWPDFWriter()
+{
+	if (!finished)
+		finish();
+	free(offsets);
+	free(pageObjects);
+}
+
+Bitu IWPDFWriter::beginObject()
+{
+	if (failed)
+		return 0;
+	if (numObjects == maxObjects)
+	{
+		long* grown = (long*)realloc(offsets, maxObjects * 2 * sizeof(long));
+		if (grown == NULL)
+		{
+			failed = true;
+			return 0;
+		}
+		offsets = grown;
+		maxObjects *= 2;
+	}
+	offsets[numObjects++] = ftell(f);
+	fprintf(f, "%i 0 obj\n", (int)numObjects);
+	return numObjects;
+}
+
+void IWPDFWriter::addPageObject(Bitu num)
+{
+	if (numPages == maxPages)
+	{
+		Bitu size = maxPages > 0 ? maxPages * 2 : 64;
+		Bitu* grown = (Bitu*)realloc(pageObjects, size * sizeof(Bitu));
+		if (grown == NULL)
+		{
+			failed = true;
+			return;
+		}
+		pageObjects = grown;
+		maxPages = size;
+	}
+	pageObjects[numPages++] = num;
+}
+
+void IWPDFWriter::beginPage(Bitu w, Bitu h, Bitu paperW, Bitu paperH, IWPDFImage kind, const IWColor* palette)
+{
+	if (failed)
+		return;
+	this->kind = kind;
+	this->paperW = paperW;
+	this->paperH = paperH;
+	rowBytes = kind == IW_PDF_BILEVEL ? (w + 7) / 8 : w;
+
+	// The length is an indirect object written after the stream
+	imageObject = beginObject();
+	fprintf(f, "<< /Type /XObject /Subtype /Image /Width %i /Height %i\n", (int)w, (int)h);
+	switch (kind)
+	{
+	case IW_PDF_BILEVEL:
+		// Decoded black is 0, black in DeviceGray
+		fprintf(f, "/ColorSpace /DeviceGray /BitsPerComponent 1\n");
+		fprintf(f, "/Filter /CCITTFaxDecode /DecodeParms << /K -1 /Columns %i /Rows %i >>\n", (int)w, (int)h);
+		break;
+	case IW_PDF_INDEXED:
+		fprintf(f, "/ColorSpace [/Indexed /DeviceRGB 255\n<");
+		for (Bitu i=0; i<256; i++)
+		{
+			fprintf(f, "%02X%02X%02X", palette[i].r, palette[i].g, palette[i].b);
+			if (i % 12 == 11)
+				fprintf(f, "\n");
+		}
+		fprintf(f, ">] /BitsPerComponent 8\n");
+		fprintf(f, "/Filter /FlateDecode\n");
+		break;
+	default:
+		// The same indices, looked up as the luminance of their palette color
+		fprintf(f, "/ColorSpace [/Indexed /DeviceGray 255\n<");
+		for (Bitu i=0; i<256; i++)
+		{
+			Bitu gray = (palette[i].r*299 + palette[i].g*587 + palette[i].b*114 + 500) / 1000;
+			fprintf(f, "%02X", (int)gray);
+			if (i % 36 == 35)
+				fprintf(f, "\n");
+		}
+		fprintf(f, ">] /BitsPerComponent 8\n");
+		fprintf(f, "/Filter /FlateDecode\n");
+		break;
+	}
+	fprintf(f, "/Length %i 0 R >>\nstream\n", (int)imageObject + 1);
+	streamStart = ftell(f);
+
+	if (kind == IW_PDF_BILEVEL)
+		fax = new IWFaxEncoder(f, w);
+	else
+		flate = new IWPSEncoder(f, level, true);
+}
+
+void IWPDFWriter::putRow(const Bit8u* row)
+{
+	if (fax != NULL)
+		fax->putRow(row);
+	else if (flate != NULL)
+		flate->putRow(row, rowBytes);
+}
+
+void IWPDFWriter::endPage()
+{
+	if (fax == NULL && flate == NULL)
+		return;
+
+	// The encoder for Flate ends binary data with a newline of its own, which is not
+	// part of the stream
+	long length;
+	if (fax != NULL)
+	{
+		fax->finish();
+		delete fax;
+		fax = NULL;
+		length = ftell(f) - streamStart;
+		fprintf(f, "\n");
+	}
+	else
+	{
+		flate->finish();
+		delete flate;
+		flate = NULL;
+		length = ftell(f) - streamStart - 1;
+	}
+	fprintf(f, "endstream\nendobj\n");
+
+	beginObject();
+	fprintf(f, "%li\nendobj\n", length);
+
+	char content[80];
+	int contentLen = snprintf(content, sizeof(content), "q %i 0 0 %i 0 0 cm /Im0 Do Q\n", (int)paperW, (int)paperH);
+	Bitu contentObject = beginObject();
+	fprintf(f, "<< /Length %i >>\nstream\n%sendstream\nendobj\n", contentLen, content);
+
+	Bitu pageObject = beginObject();
+	fprintf(f, "<< /Type /Page /Parent 2 0 R /MediaBox [0 0 %i %i]\n", (int)paperW, (int)paperH);
+	fprintf(f, "/Resources << /XObject << /Im0 %i 0 R >> >>\n", (int)imageObject);
+	fprintf(f, "/Contents %i 0 R >>\nendobj\n", (int)contentObject);
+	addPageObject(pageObject);
+
+	// The page is complete in the file
+	fflush(f);
+}
+
+bool IWPDFWriter::finish()
+{
+	if (finished)
+		return !failed;
+	endPage();
+	finished = true;
+
+	if (!failed)
+	{
+		offsets[0] = ftell(f);
+		fprintf(f, "1 0 obj\n<< /Type /Catalog /Pages 2 0 R >>\nendobj\n");
+		offsets[1] = ftell(f);
+		fprintf(f, "2 0 obj\n<< /Type /Pages /Count %i\n/Kids [", (int)numPages);
+		for (Bitu i=0; i<numPages; i++)
+			fprintf(f, "%s%i 0 R", i % 8 == 7 ? "\n" : (i > 0 ? " " : ""), (int)pageObjects[i]);
+		fprintf(f, "] >>\nendobj\n");
+		Bitu infoObject = beginObject();
+		fprintf(f, "<< /Producer (GSport Virtual Printer) >>\nendobj\n");
+
+		// Every entry is exactly 20 bytes
+		long xref = ftell(f);
+		fprintf(f, "xref\n0 %i\n", (int)numObjects + 1);
+		fprintf(f, "0000000000 65535 f\r\n");
+		for (Bitu i=0; i<numObjects; i++)
+			fprintf(f, "%010li 00000 n\r\n", offsets[i]);
+		fprintf(f, "trailer\n<< /Size %i /Root 1 0 R /Info %i 0 R >>\n", (int)numObjects + 1, (int)infoObject);
+		fprintf(f, "startxref\n%li\n%%%%EOF\n", xref);
+	}
+
+	if (ferror(f))
+		failed = true;
+	if (fclose(f) != 0)
+		failed = true;
+	return !failed;
+}
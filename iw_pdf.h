@@ -0,0 +1,78 @@
+/*
+ * PDF writer that streams pages to the file.
+ *
+ * Each page is an image XObject drawn over the whole MediaBox. Its data is
+ * encoded straight into the file while the rows come in: Flate for gray and
+ * palette images (the same binary zlib stream PostScript 3 pages use) and
+ * CCITT Group 4 for black and white pages. The length of an image stream is
+ * only known at its end, so it goes into an object of its own after the
+ * stream. Once a page is done its objects are flushed and nothing of it is
+ * kept but the file offsets; the page tree, the cross-reference table and
+ * the trailer follow in finish().
+ *
+ * Objects 1 and 2 are the catalog and the page tree, written last, so that
+ * the pages can point to their parent before it exists.
+ *
+ * Needs zlib (HAVE_ZLIB).
+ */
+#ifndef IW_PDF_H
+#define IW_PDF_H
+
+#include "imagewriter.h"
+#include <stdio.h>
+
+enum IWPDFImage {
+	IW_PDF_GRAY,						// 8-bit palette indices, shown as the luminance of their color
+	IW_PDF_INDEXED,						// 8-bit palette indices
+	IW_PDF_BILEVEL						// 1-bit, 1 = black ink, Group 4 encoded
+};
+
+class IWPSEncoder;
+class IWFaxEncoder;
+
+class IWPDFWriter {
+public:
+	// Starts a document in f, which the writer closes in finish(). level is the zlib level 1-9
+	IWPDFWriter(FILE* f, int level);
+	~IWPDFWriter();
+
+	// Starts a page of paperW x paperH points covered by an image of w x h pixels
+	void beginPage(Bitu w, Bitu h, Bitu paperW, Bitu paperH, IWPDFImage kind, const IWColor* palette);
+
+	// Adds the next image row: w bytes, or (w+7)/8 bytes for IW_PDF_BILEVEL
+	void putRow(const Bit8u* row);
+
+	// Ends the image, writes the rest of the page and flushes it to the file
+	void endPage();
+
+	// Writes the page tree, the cross-reference table and the trailer and closes the
+	// file. False if anything could not be written
+	bool finish();
+
+private:
+	Bitu beginObject();
+	void addPageObject(Bitu num);
+
+	FILE* f;
+	int level;
+	long* offsets;						// File position of each object, index 0 = object 1
+	Bitu numObjects;
+	Bitu maxObjects;
+	Bitu* pageObjects;
+	Bitu numPages;
+	Bitu maxPages;
+
+	// The page being written
+	IWPDFImage kind;
+	Bitu rowBytes;
+	Bitu paperW, paperH;
+	Bitu imageObject;
+	long streamStart;
+	IWPSEncoder* flate;
+	IWFaxEncoder* fax;
+
+	bool failed;
+	bool finished;
+};
+
+#endif
@@ -0,0 +1,349 @@
+#include "iw_png.h"
+#include "iw_pagebuf.h"
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#if defined (WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#define IW_PNG_MAX_CHUNK        0x7FFFFFFF	// Largest chunk length PNG allows
+
+struct IWPNGBand {
+	Bit8u* in;							// Rows with their filter type bytes
+	Bitu inLen;
+	const Bit8u* dict;					// The bytes just before in, to prime the compressor
+	Bitu dictLen;
+	Bit8u* out;							// Raw deflate data
+	Bitu outLen;						// 0 if the band could not be compressed
+	Bitu outSize;
+	Bit32u adler;						// Adler-32 of in
+	int level;
+	bool last;							// Ends the stream instead of flushing
+};
+
+static void putBE32(Bit8u* p, Bit32u v)
+{
+	p[0] = (Bit8u)(v >> 24);
+	p[1] = (Bit8u)(v >> 16);
+	p[2] = (Bit8u)(v >> 8);
+	p[3] = (Bit8u)v;
+}
+
+static void compressBand(IWPNGBand* band)
+{
+	band->outLen = 0;
+	band->adler = adler32(adler32(0, NULL, 0), band->in, band->inLen);
+
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, band->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return;
+	if (band->dictLen > 0 && deflateSetDictionary(&zs, band->dict, band->dictLen) != Z_OK)
+	{
+		deflateEnd(&zs);
+		return;
+	}
+
+	// The buffer fits the data in one call: the bound plus the sync flush marker
+	Bitu size = deflateBound(&zs, band->inLen) + 16;
+	if (size > band->outSize)
+	{
+		free(band->out);
+		band->out = (Bit8u*)malloc(size);
+		band->outSize = band->out != NULL ? size : 0;
+	}
+	if (band->out != NULL)
+	{
+		zs.next_in = band->in;
+		zs.avail_in = band->inLen;
+		zs.next_out = band->out;
+		zs.avail_out = band->outSize;
+		// The buffer takes all of it: anything short of the flush asked for fails the band
+		int ret = deflate(&zs, band->last ? Z_FINISH : Z_SYNC_FLUSH);
+		if (ret == (band->last ? Z_STREAM_END : Z_OK) && zs.avail_in == 0)
+			band->outLen = band->outSize - zs.avail_out;
+	}
+	deflateEnd(&zs);
+}
+
+#if defined (WIN32)
+static DWORD WINAPI bandThread(LPVOID arg)
+{
+	compressBand((IWPNGBand*)arg);
+	return 0;
+}
+#else
+static void* bandThread(void* arg)
+{
+	compressBand((IWPNGBand*)arg);
+	return NULL;
+}
+#endif
+
+// Compresses the bands, the first one on the calling thread
+static void compressBandsParallel(IWPNGBand* bands, Bitu n)
+{
+#if defined (WIN32)
+	HANDLE threads[IW_PNG_MAX_THREADS];
+	for (Bitu i=1; i<n; i++)
+		threads[i] = CreateThread(NULL, 0, bandThread, &bands[i], 0, NULL);
+	compressBand(&bands[0]);
+	for (Bitu i=1; i<n; i++)
+	{
+		if (threads[i] == NULL)
+			compressBand(&bands[i]);
+		else
+		{
+			WaitForSingleObject(threads[i], INFINITE);
+			CloseHandle(threads[i]);
+		}
+	}
+#else
+	pthread_t threads[IW_PNG_MAX_THREADS];
+	bool started[IW_PNG_MAX_THREADS];
+	for (Bitu i=1; i<n; i++)
+		started[i] = pthread_create(&threads[i], NULL, bandThread, &bands[i]) == 0;
+	compressBand(&bands[0]);
+	for (Bitu i=1; i<n; i++)
+	{
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			compressBand(&bands[i]);
+	}
+#endif
+}
+
+Bitu IWPNGWriter::defaultThreads()
+{
+	long n;
+#if defined (WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	n = info.dwNumberOfProcessors;
+#else
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (n < 1) return 1;
+	if (n > IW_PNG_MAX_THREADS) return IW_PNG_MAX_THREADS;
+	return (Bitu)n;
+}
+
+IWPNGWriter::IWPNGWriter(FILE* f, Bitu w, Bitu h, Bitu bits, const IWColor* palette, Bitu numColors, Bitu dpi, int level, Bitu threads)
+{
+	this->f = f;
+	this->level = level < 1 ? 1 : (level > 9 ? 9 : level);
+	rowBytes = 1 + (w*bits + 7) / 8;
+	bandRows = IW_PNG_BAND / rowBytes;
+	if (bandRows < 1) bandRows = 1;
+	numThreads = threads < 1 ? 1 : (threads > IW_PNG_MAX_THREADS ? IW_PNG_MAX_THREADS : threads);
+	curBand = 0;
+	windowLen = 0;
+	adler = adler32(0, NULL, 0);
+	idatPos = -1;
+	idatLen = 0;
+	idatCrc = 0;
+	failed = false;
+	finished = false;
+
+	bands = (IWPNGBand*)calloc(numThreads, sizeof(IWPNGBand));
+	window = (Bit8u*)malloc(IW_PNG_WINDOW);
+	for (Bitu i=0; bands != NULL && i<numThreads; i++)
+	{
+		bands[i].in = (Bit8u*)malloc(bandRows * rowBytes);
+		if (bands[i].in == NULL)
+			failed = true;
+	}
+	if (bands == NULL || window == NULL)
+		failed = true;
+
+	static const Bit8u signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	fwrite(signature, 1, 8, f);
+
+	// Palettized, no interlace
+	Bit8u ihdr[13];
+	putBE32(&ihdr[0], (Bit32u)w);
+	putBE32(&ihdr[4], (Bit32u)h);
+	ihdr[8] = (Bit8u)bits;
+	ihdr[9] = 3;
+	ihdr[10] = ihdr[11] = ihdr[12] = 0;
+	writeChunk("IHDR", ihdr, 13);
+
+	Bit8u plte[256*3];
+	for (Bitu i=0; i<numColors; i++)
+	{
+		plte[i*3] = palette[i].r;
+		plte[i*3+1] = palette[i].g;
+		plte[i*3+2] = palette[i].b;
+	}
+	writeChunk("PLTE", plte, numColors*3);
+
+	// Pixels per meter
+	Bit8u phys[9];
+	Bit32u ppm = (Bit32u)(dpi / 0.0254 + 0.5);
+	putBE32(&phys[0], ppm);
+	putBE32(&phys[4], ppm);
+	phys[8] = 1;
+	writeChunk("pHYs", phys, 9);
+
+	// zlib header for a 32 KB window, with the level hint
+	Bit8u header[2] = { 0x78, 0x9C };
+	if (this->level == 1) header[1] = 0x01;
+	else if (this->level < 6) header[1] = 0x5E;
+	else if (this->level > 6) header[1] = 0xDA;
+	writeIDAT(header, 2);
+}
+
+IWPNGWriter::~IWPNGWriter()
+{
+	if (!finished)
+		finish();
+	for (Bitu i=0; bands != NULL && i<numThreads; i++)
+	{
+		free(bands[i].in);
+		free(bands[i].out);
+	}
+	free(bands);
+	free(window);
+}
+
+void IWPNGWriter::writeChunk(const char* type, const Bit8u* data, Bitu len)
+{
+	Bit8u head[8];
+	putBE32(&head[0], (Bit32u)len);
+	memcpy(&head[4], type, 4);
+	Bit32u crc = crc32(crc32(0, NULL, 0), &head[4], 4);
+	if (len > 0)
+		crc = crc32(crc, data, len);		// A NULL buffer would reset the CRC
+	Bit8u tail[4];
+	putBE32(tail, crc);
+	if (fwrite(head, 1, 8, f) != 8 || fwrite(data, 1, len, f) != len || fwrite(tail, 1, 4, f) != 4)
+		failed = true;
+}
+
+void IWPNGWriter::writeIDAT(const Bit8u* data, Bitu len)
+{
+	while (len > 0)
+	{
+		if (idatPos < 0)
+		{
+			// The length is filled in by closeIDAT()
+			static const Bit8u head[8] = { 0, 0, 0, 0, 'I', 'D', 'A', 'T' };
+			idatPos = ftell(f);
+			fwrite(head, 1, 8, f);
+			idatLen = 0;
+			idatCrc = crc32(crc32(0, NULL, 0), &head[4], 4);
+		}
+		Bitu n = len < IW_PNG_MAX_CHUNK - idatLen ? len : IW_PNG_MAX_CHUNK - idatLen;
+		if (fwrite(data, 1, n, f) != n)
+			failed = true;
+		idatCrc = crc32(idatCrc, data, n);
+		idatLen += n;
+		data += n;
+		len -= n;
+		if (idatLen == IW_PNG_MAX_CHUNK)
+			closeIDAT();
+	}
+}
+
+void IWPNGWriter::closeIDAT()
+{
+	if (idatPos < 0)
+		return;
+	Bit8u tail[4];
+	putBE32(tail, idatCrc);
+	fwrite(tail, 1, 4, f);
+	long end = ftell(f);
+	Bit8u len[4];
+	putBE32(len, idatLen);
+	if (fseek(f, idatPos, SEEK_SET) != 0 || fwrite(len, 1, 4, f) != 4 || fseek(f, end, SEEK_SET) != 0)
+		failed = true;
+	idatPos = -1;
+}
+
+void IWPNGWriter::compressBands(bool last)
+{
+	Bitu n = curBand;
+	if (n == 0 || failed)
+		return;
+
+	// Each band is primed with the tail of the one before
+	for (Bitu i=0; i<n; i++)
+	{
+		IWPNGBand* band = &bands[i];
+		band->level = level;
+		band->last = last && i == n-1;
+		if (i == 0)
+		{
+			band->dict = window;
+			band->dictLen = windowLen;
+		}
+		else
+		{
+			Bitu prev = bands[i-1].inLen;
+			band->dictLen = prev < IW_PNG_WINDOW ? prev : IW_PNG_WINDOW;
+			band->dict = bands[i-1].in + prev - band->dictLen;
+		}
+	}
+	compressBandsParallel(bands, n);
+
+	for (Bitu i=0; i<n; i++)
+	{
+		if (bands[i].out == NULL || bands[i].outLen == 0)
+			failed = true;
+		writeIDAT(bands[i].out, bands[i].outLen);
+		adler = adler32_combine(adler, bands[i].adler, bands[i].inLen);
+	}
+
+	// Keep the tail for the next batch
+	windowLen = bands[n-1].inLen < IW_PNG_WINDOW ? bands[n-1].inLen : IW_PNG_WINDOW;
+	memcpy(window, bands[n-1].in + bands[n-1].inLen - windowLen, windowLen);
+
+	for (Bitu i=0; i<n; i++)
+		bands[i].inLen = 0;
+	curBand = 0;
+}
+
+void IWPNGWriter::putRow(const Bit8u* row)
+{
+	if (failed)
+		return;
+	IWPNGBand* band = &bands[curBand];
+	Bit8u* dst = band->in + band->inLen;
+	dst[0] = 0;							// Filter type None, as suggested for palette images
+	memcpy(dst + 1, row, rowBytes - 1);
+	band->inLen += rowBytes;
+	if (band->inLen == bandRows * rowBytes && ++curBand == numThreads)
+		compressBands(false);
+}
+
+bool IWPNGWriter::finish()
+{
+	if (finished)
+		return !failed;
+	finished = true;
+	if (failed)
+		return false;
+
+	if (curBand < numThreads && bands[curBand].inLen > 0)
+		curBand++;
+	if (curBand == 0)
+	{
+		// All rows went out with sync flushes: an empty final block ends the stream
+		static const Bit8u end[2] = { 0x03, 0x00 };
+		writeIDAT(end, 2);
+	}
+	else
+		compressBands(true);
+
+	Bit8u trailer[4];
+	putBE32(trailer, adler);
+	writeIDAT(trailer, 4);
+	closeIDAT();
+	writeChunk("IEND", NULL, 0);
+	return !failed;
+}
@@ -0,0 +1,70 @@
+/*
+ * PNG writer with parallel compression.
+ *
+ * Pages go out palettized, at 8 bits per pixel or at 1 bit for black and
+ * white pages, with the page resolution in a pHYs chunk. The rows are cut
+ * into bands of about IW_PNG_BAND bytes that are deflated side by side,
+ * one thread per band, each primed with the last 32 KB of the band before
+ * it. Every band but the last ends on a sync flush, so the raw deflate
+ * streams simply follow each other behind one zlib header and make a
+ * single stream with the combined Adler-32. It is written as one IDAT
+ * chunk whose length is filled in when the stream is done.
+ *
+ * The rows are handed over from the printer thread, which keeps the page
+ * strips to itself; only the compression runs in the band threads.
+ *
+ * Needs zlib (HAVE_ZLIB).
+ */
+#ifndef IW_PNG_H
+#define IW_PNG_H
+
+#include "imagewriter.h"
+#include <stdio.h>
+
+#define IW_PNG_BAND             (256*1024)	// Bytes of rows compressed by one thread
+#define IW_PNG_MAX_THREADS      32
+#define IW_PNG_WINDOW           32768		// Tail of a band that primes the next one
+
+struct IWPNGBand;
+
+class IWPNGWriter {
+public:
+	// Starts a PNG file of w x h pixels of bits (1 or 8) per pixel with numColors palette
+	// entries. level is the zlib level 1-9, threads the number of bands compressed at once
+	IWPNGWriter(FILE* f, Bitu w, Bitu h, Bitu bits, const IWColor* palette, Bitu numColors, Bitu dpi, int level, Bitu threads);
+	~IWPNGWriter();
+
+	// Number of threads to use by default: the processors online
+	static Bitu defaultThreads();
+
+	// Adds the next row of (w*bits+7)/8 bytes
+	void putRow(const Bit8u* row);
+
+	// Compresses the rows still buffered and writes the end of the file. False if
+	// anything could not be written
+	bool finish();
+
+private:
+	void compressBands(bool last);
+	void writeChunk(const char* type, const Bit8u* data, Bitu len);
+	void writeIDAT(const Bit8u* data, Bitu len);
+	void closeIDAT();
+
+	FILE* f;
+	Bitu rowBytes;						// Bytes of a row including its filter type
+	Bitu bandRows;						// Rows of a full band
+	int level;
+	Bitu numThreads;
+	IWPNGBand* bands;
+	Bitu curBand;						// Band being filled
+	Bit8u* window;						// Tail of the last compressed band
+	Bitu windowLen;
+	Bit32u adler;						// Adler-32 of all rows so far
+	long idatPos;						// File position of the open IDAT chunk, -1 = none
+	Bit32u idatLen;
+	Bit32u idatCrc;
+	bool failed;
+	bool finished;
+};
+
+#endif
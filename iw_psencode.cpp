@@ -0,0 +1,388 @@
+#include "iw_psencode.h"
+#include <stdio.h>
+#include <string.h>
+
+#define IW_PS_ONES              ((Bit64u)0x0101010101010101ULL)
+#define IW_PS_HIGHS             ((Bit64u)0x8080808080808080ULL)
+
+// True if one of the bytes of w is 0
+static inline bool hasZeroByte(Bit64u w)
+{
+	return ((w - IW_PS_ONES) & ~w & IW_PS_HIGHS) != 0;
+}
+
+static inline Bit64u loadWord(const Bit8u* p)
+{
+	Bit64u w;
+	memcpy(&w, p, sizeof(w));
+	return w;
+}
+
+IWPSEncoder::IWPSEncoder(FILE* f, int deflate, bool binary)
+{
+	this->f = f;
+	this->binary = binary;
+	outLen = 0;
+	column = 0;
+	tupleLen = 0;
+	finished = false;
+#ifdef HAVE_ZLIB
+	flate = deflate > 0;
+	stored = false;
+	failed = false;
+	if (flate)
+	{
+		memset(&zs, 0, sizeof(zs));
+		int ret = deflateInit(&zs, deflate > 9 ? 9 : deflate);
+		if (ret != Z_OK)
+		{
+			printf("Printer: zlib could not be set up (error %i), image data goes out uncompressed\n", ret);
+			beginStored();
+		}
+	}
+#else
+	(void)deflate;
+#endif
+}
+
+IWPSEncoder::~IWPSEncoder()
+{
+	if (!finished)
+		finish();
+}
+
+void IWPSEncoder::fprintFilters(FILE* f, int deflate, bool binary)
+{
+	if (!binary)
+		fprintf(f, "/ASCII85Decode filter\n");
+#ifdef HAVE_ZLIB
+	if (deflate > 0)
+	{
+		fprintf(f, "/FlateDecode filter\n");
+		return;
+	}
+#else
+	(void)deflate;
+#endif
+	fprintf(f, "/RunLengthDecode filter\n");
+}
+
+void IWPSEncoder::flush()
+{
+	if (outLen > 0)
+		fwrite(out, 1, outLen, f);
+	outLen = 0;
+}
+
+void IWPSEncoder::putTuple(Bitu bytes)
+{
+	// Room for five characters, their line breaks and a leading space
+	if (outLen + 16 > IW_PS_BUFFER)
+		flush();
+
+	Bit32u num = (Bit32u)tuple[0] << 24 | (Bit32u)tuple[1] << 16 | (Bit32u)tuple[2] << 8 | (Bit32u)tuple[3];
+	if (num == 0 && bytes == 4)
+	{
+		out[outLen++] = 'z';
+		if (++column >= IW_PS_COLUMNS)
+		{
+			column = 0;
+			out[outLen++] = '\n';
+		}
+		return;
+	}
+
+	char chars[5];
+	for (int i=4; i>=0; i--)
+	{
+		chars[i] = (char)(num % 85 + 33);
+		num /= 85;
+	}
+
+	// Make sure a line never starts with a % (which may be mistaken as start of a comment)
+	if (column == 0 && chars[0] == '%')
+		out[outLen++] = ' ';
+
+	// A partial tuple of n bytes takes n+1 characters
+	Bitu numChars = bytes + 1;
+	if (column + numChars < IW_PS_COLUMNS)
+	{
+		memcpy(&out[outLen], chars, numChars);
+		outLen += numChars;
+		column += numChars;
+	}
+	else
+	{
+		for (Bitu i=0; i<numChars; i++)
+		{
+			if (column == 0 && chars[i] == '%')
+				out[outLen++] = ' ';
+			out[outLen++] = chars[i];
+			if (++column >= IW_PS_COLUMNS)
+			{
+				column = 0;
+				out[outLen++] = '\n';
+			}
+		}
+	}
+}
+
+void IWPSEncoder::putByte(Bit8u b)
+{
+	if (binary)
+	{
+		if (outLen == IW_PS_BUFFER)
+			flush();
+		out[outLen++] = (char)b;
+		return;
+	}
+	tuple[tupleLen++] = b;
+	if (tupleLen == 4)
+	{
+		putTuple(4);
+		tupleLen = 0;
+	}
+}
+
+void IWPSEncoder::putBytes(const Bit8u* data, Bitu len)
+{
+	if (binary)
+	{
+		while (len > 0)
+		{
+			if (outLen == IW_PS_BUFFER)
+				flush();
+			Bitu n = IW_PS_BUFFER - outLen < len ? IW_PS_BUFFER - outLen : len;
+			memcpy(&out[outLen], data, n);
+			outLen += n;
+			data += n;
+			len -= n;
+		}
+		return;
+	}
+
+	// Whole tuples straight from the data once the pending bytes are filled up
+	while (len > 0 && tupleLen > 0)
+	{
+		putByte(*data++);
+		len--;
+	}
+	while (len >= 4)
+	{
+		memcpy(tuple, data, 4);
+		putTuple(4);
+		data += 4;
+		len -= 4;
+	}
+	while (len-- > 0)
+		putByte(*data++);
+}
+
+#ifdef HAVE_ZLIB
+void IWPSEncoder::deflateBytes(const Bit8u* data, Bitu len, int mode)
+{
+	if (stored)
+	{
+		storeBytes(data, len, mode == Z_FINISH);
+		return;
+	}
+	if (failed)
+		return;
+	zs.next_in = (Bytef*)data;
+	zs.avail_in = len;
+	do
+	{
+		zs.next_out = zout;
+		zs.avail_out = IW_PS_CHUNK;
+		// Z_BUF_ERROR only means there was nothing to do
+		int ret = deflate(&zs, mode);
+		if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+		{
+			printf("Printer: compressing image data failed (zlib error %i), the image is cut short\n", ret);
+			failed = true;
+			return;
+		}
+		putBytes(zout, IW_PS_CHUNK - zs.avail_out);
+	} while (zs.avail_out == 0);
+}
+
+void IWPSEncoder::beginStored()
+{
+	// FlateDecode is announced already: a zlib header for stored data without compression
+	static const Bit8u header[2] = { 0x78, 0x01 };
+	stored = true;
+	storedLen = 0;
+	adler = adler32(0, NULL, 0);
+	putBytes(header, 2);
+}
+
+void IWPSEncoder::storeBytes(const Bit8u* data, Bitu len, bool last)
+{
+	if (len > 0)
+		adler = adler32(adler, data, len);	// A NULL buffer would reset the checksum
+	while (len > 0)
+	{
+		Bitu n = IW_PS_CHUNK - storedLen < len ? IW_PS_CHUNK - storedLen : len;
+		memcpy(&zout[storedLen], data, n);
+		storedLen += n;
+		data += n;
+		len -= n;
+		if (storedLen == IW_PS_CHUNK)
+			putStoredBlock(false);
+	}
+	if (last)
+	{
+		putStoredBlock(true);
+		Bit8u trailer[4] = { (Bit8u)(adler >> 24), (Bit8u)(adler >> 16), (Bit8u)(adler >> 8), (Bit8u)adler };
+		putBytes(trailer, 4);
+	}
+}
+
+void IWPSEncoder::putStoredBlock(bool last)
+{
+	// Block type 0: the length and its complement, then the bytes as they are
+	Bit8u head[5];
+	head[0] = last ? 1 : 0;
+	head[1] = (Bit8u)storedLen;
+	head[2] = (Bit8u)(storedLen >> 8);
+	head[3] = (Bit8u)~storedLen;
+	head[4] = (Bit8u)(~storedLen >> 8);
+	putBytes(head, 5);
+	putBytes(zout, storedLen);
+	storedLen = 0;
+}
+#endif
+
+void IWPSEncoder::putRow(const Bit8u* data, Bitu len, Bit8u invert)
+{
+#ifdef HAVE_ZLIB
+	if (flate)
+	{
+		if (invert == 0)
+			deflateBytes(data, len, Z_NO_FLUSH);
+		else
+		{
+			for (Bitu pos=0; pos<len; pos += IW_PS_CHUNK)
+			{
+				Bitu n = len - pos < IW_PS_CHUNK ? len - pos : IW_PS_CHUNK;
+				for (Bitu i=0; i<n; i++)
+					chunk[i] = data[pos+i] ^ invert;
+				deflateBytes(chunk, n, Z_NO_FLUSH);
+			}
+		}
+		return;
+	}
+#endif
+
+	Bitu pos = 0;
+	while (pos < len)
+	{
+		Bitu end = (len - pos > 128) ? pos + 128 : len;
+		Bit8u c = data[pos];
+		if (pos+2 < len && data[pos+1] == c && data[pos+2] == c)
+		{
+			// Three or more equal bytes, extended a word at a time
+			Bit64u same = IW_PS_ONES * c;
+			Bitu p = pos + 3;
+			while (p + 8 <= end && loadWord(&data[p]) == same)
+				p += 8;
+			while (p < end && data[p] == c)
+				p++;
+			putByte((Bit8u)(257 - (p - pos)));
+			putByte(c ^ invert);
+			pos = p;
+		}
+		else
+		{
+			// Literal bytes up to the next run of three. Eight positions are checked at once
+			// by comparing the data with itself shifted by one and two bytes
+			Bitu p = pos + 1;
+			while (p < end)
+			{
+				if (p + 8 <= end && p + 10 <= len)
+				{
+					Bit64u w = loadWord(&data[p]);
+					if (!hasZeroByte((w ^ loadWord(&data[p+1])) | (w ^ loadWord(&data[p+2]))))
+					{
+						p += 8;
+						continue;
+					}
+				}
+				if (p+2 < len && data[p] == data[p+1] && data[p] == data[p+2])
+					break;
+				p++;
+			}
+			putByte((Bit8u)(p - pos - 1));
+			for (; pos < p; pos++)
+				putByte(data[pos] ^ invert);
+		}
+	}
+}
+
+void IWPSEncoder::putRepeat(Bit8u value, Bitu len)
+{
+#ifdef HAVE_ZLIB
+	if (flate)
+	{
+		memset(chunk, value, len < IW_PS_CHUNK ? len : IW_PS_CHUNK);
+		for (Bitu pos=0; pos<len; pos += IW_PS_CHUNK)
+			deflateBytes(chunk, len - pos < IW_PS_CHUNK ? len - pos : IW_PS_CHUNK, Z_NO_FLUSH);
+		return;
+	}
+#endif
+
+	while (len >= 3)
+	{
+		Bitu n = len > 128 ? 128 : len;
+		putByte((Bit8u)(257 - n));
+		putByte(value);
+		len -= n;
+	}
+	if (len > 0)
+	{
+		putByte((Bit8u)(len - 1));
+		while (len-- > 0)
+			putByte(value);
+	}
+}
+
+void IWPSEncoder::finish()
+{
+#ifdef HAVE_ZLIB
+	if (flate)
+	{
+		// The Flate stream ends itself
+		deflateBytes(NULL, 0, Z_FINISH);
+		if (!stored)
+			deflateEnd(&zs);
+	}
+	else
+#endif
+		putByte(128);					// EOD of RunLengthDecode
+
+	if (binary)
+	{
+		if (outLen == IW_PS_BUFFER)
+			flush();
+		out[outLen++] = '\n';
+		flush();
+		finished = true;
+		return;
+	}
+
+	// Partial tuple if there are still bytes in the buffer
+	if (tupleLen > 0)
+	{
+		for (Bitu i=tupleLen; i<4; i++)
+			tuple[i] = 0;
+		putTuple(tupleLen);
+		tupleLen = 0;
+	}
+
+	if (outLen + 3 > IW_PS_BUFFER)
+		flush();
+	memcpy(&out[outLen], "~>\n", 3);
+	outLen += 3;
+	flush();
+	finished = true;
+}
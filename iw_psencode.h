@@ -0,0 +1,96 @@
+/*
+ * PostScript image data encoder.
+ *
+ * Turns page rows into the data stream the image operators read from
+ * currentfile. Rows go in whole and the encoded text collects in one large
+ * buffer that is written out with a single fwrite() when it fills, instead
+ * of a stdio call per character.
+ *
+ * Level 2 data is run-length encoded. Runs are looked for a machine word at
+ * a time: long white stretches and areas without runs are skipped eight
+ * bytes per step. Each row is encoded on its own, so runs never cross a row
+ * boundary. Level 3 data (builds with HAVE_ZLIB) is one Flate stream for
+ * the whole image, which also catches the repeating patterns of dithered
+ * graphics.
+ *
+ * Should zlib fail to set up, the Flate stream is still written, in stored
+ * blocks of raw data, since the filters are printed before the encoder is
+ * made. A compression error later on cuts the image short and is reported.
+ *
+ * Either goes through ASCII85, which turns four bytes at once into five
+ * characters and keeps the file 7-bit clean. Binary data skips it for
+ * spoolers and interpreters that take 8-bit PostScript. The binary Flate
+ * form is also what PDF image streams hold.
+ *
+ * The encoder is meant to live for one image: the caller prints the image
+ * header with fprintFilters(), creates the encoder, puts the rows and calls
+ * finish() before printing anything else to the file.
+ */
+#ifndef IW_PSENCODE_H
+#define IW_PSENCODE_H
+
+#include "imagewriter.h"
+#include <stdio.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#define IW_PS_BUFFER            65536		// Bytes of text collected before writing
+#define IW_PS_COLUMNS           79			// Line length of the ASCII85 text
+#define IW_PS_CHUNK             4096		// Bytes passed through zlib at once
+
+class IWPSEncoder {
+public:
+	// deflate is the zlib compression level 1-9, or 0 for run-length encoding. Binary
+	// data is written without ASCII85
+	IWPSEncoder(FILE* f, int deflate, bool binary);
+	~IWPSEncoder();
+
+	// Prints the decode filters for data from an encoder set up the same way, to be
+	// applied to the source on the operand stack
+	static void fprintFilters(FILE* f, int deflate, bool binary);
+
+	// Encodes len bytes of a row, each XORed with invert (0xFF turns 0 = white into 255 = white)
+	void putRow(const Bit8u* data, Bitu len, Bit8u invert = 0);
+
+	// Encodes len bytes of the same value, e.g. a blank row
+	void putRepeat(Bit8u value, Bitu len);
+
+	// Ends the data and flushes the buffer
+	void finish();
+
+	// The checks in tests/ switch to the stored Flate fallback
+	friend class IWEncoderTest;
+
+private:
+	void putByte(Bit8u b);
+	void putBytes(const Bit8u* data, Bitu len);
+	void putTuple(Bitu bytes);
+	void flush();
+
+	FILE* f;
+	bool binary;
+	char out[IW_PS_BUFFER];				// Text not yet written
+	Bitu outLen;
+	Bitu column;						// Characters on the current line
+	Bit8u tuple[4];						// Bytes waiting for a full ASCII85 group
+	Bitu tupleLen;
+	bool finished;
+#ifdef HAVE_ZLIB
+	void deflateBytes(const Bit8u* data, Bitu len, int mode);
+	void beginStored();
+	void storeBytes(const Bit8u* data, Bitu len, bool last);
+	void putStoredBlock(bool last);
+
+	bool flate;							// Rows go through zlib instead of run-length encoding
+	bool stored;						// zlib could not be set up: the Flate stream is made of stored blocks
+	bool failed;						// deflate() failed, the rest of the data is dropped
+	Bitu storedLen;						// Bytes in zout waiting for a stored block
+	Bit32u adler;						// Adler-32 of the stored data
+	z_stream zs;
+	Bit8u chunk[IW_PS_CHUNK];			// Inverted or repeated bytes on their way into zlib
+	Bit8u zout[IW_PS_CHUNK];			// Compressed bytes on their way out
+#endif
+};
+
+#endif
@@ -256,6 +256,51 @@ static void set_output_timestamp(void)
 	}
 }
 
+/* Apple II preprocessing of serial data (also used when replaying session dumps).
+ * The translated bytes are handed to the printer in blocks so text runs render together. */
+static void apple2_preprocess_feed(const unsigned char *buf, int n)
+{
+	unsigned char out[512];
+	int len = 0;
+	for (int i = 0; i < n; i++) {
+		const char *p = NULL;
+		unsigned char b = buf[i];
+		/* Keep room for the longest expansion below */
+		if (len > (int)sizeof(out) - 8) {
+			imagewriter_write(out, len);
+			len = 0;
+		}
+		/* Apple II: map line-ending codes to CR */
+		if (b == 0x8D || b == 0xFD || b == 0xA9) {
+			out[len++] = 0x0D;
+			continue;
+		}
+		/* Apple II IIc: 0xE0 often appears as digit 0 in LIST output */
+		if (b == 0xE0) {
+			out[len++] = 0x30;
+			continue;
+		}
+		/* IIc LIST: 0xB2 0xB9 sequence observed for PRINT keyword */
+		if (b == 0xB2 && i + 1 < n && buf[i + 1] == 0xB9) {
+			p = "PRINT ";
+			i++;
+		}
+		/* Applesoft tokens for LIST output */
+		else if (b == 0xBA) p = "PRINT ";
+		else if (b == 0xAB) p = "GOTO ";
+		if (p) {
+			while (*p)
+				out[len++] = (unsigned char)*p++;
+			continue;
+		}
+		/* ImageWriter Technical Reference: 8th bit is always 1 for data, 0 for control codes.
+		 * Strip high bit only when set to get 7-bit ASCII; pass control codes through. */
+		out[len++] = (b & 0x80) ? (b & 0x7F) : b;
+	}
+	if (len > 0)
+		imagewriter_write(out, len);
+}
+
 /* Run serial mode (shared by CLI and interactive) */
 static int run_serial(const char *port_path, int baud, long dpi, int paper, long banner,
 	const char *output, int multipage, int debug, const char *printer, int verbose)
@@ -263,9 +308,6 @@ static int run_serial(const char *port_path, int baud, long dpi, int paper, long
 	serial_port_t *port = serial_open(port_path, baud);
 	if (!port) return EXIT_FAILURE;
 
-	setenv("SDL_VIDEODRIVER", "dummy", 1);
-	setenv("SDL_AUDIODRIVER", "dummy", 1);
-
 	if (verbose)
 		imagewriter_set_status_callback(status_callback);
 	if (printer && printer[0])
@@ -325,32 +367,7 @@ static int run_serial(const char *port_path, int baud, long dpi, int paper, long
 			idle_count = 0;
 			if (sessionFile && fwrite(buf, 1, (size_t)n, sessionFile) != (size_t)n)
 				perror("Session file write");
-			for (int i = 0; i < n; i++) {
-				unsigned char b = buf[i];
-				/* Apple II: map line-ending codes to CR */
-				if (b == 0x8D || b == 0xFD || b == 0xA9) {
-					imagewriter_loop(0x0D);
-					continue;
-				}
-				/* Apple II IIc: 0xE0 often appears as digit 0 in LIST output */
-				if (b == 0xE0) {
-					imagewriter_loop(0x30);
-					continue;
-				}
-				/* IIc LIST: 0xB2 0xB9 sequence observed for PRINT keyword */
-				if (b == 0xB2 && i + 1 < n && buf[i + 1] == 0xB9) {
-					for (const char *p = "PRINT "; *p; p++)
-						imagewriter_loop((unsigned char)*p);
-					i++;
-					continue;
-				}
-				/* Applesoft tokens for LIST output */
-				if (b == 0xBA) { for (const char *p = "PRINT "; *p; p++) imagewriter_loop((unsigned char)*p); continue; }
-				if (b == 0xAB) { for (const char *p = "GOTO "; *p; p++) imagewriter_loop((unsigned char)*p); continue; }
-				/* ImageWriter Technical Reference: 8th bit is always 1 for data, 0 for control codes.
-				 * Strip high bit only when set to get 7-bit ASCII; pass control codes through. */
-				imagewriter_loop((b & 0x80) ? (b & 0x7F) : b);
-			}
+			apple2_preprocess_feed(buf, n);
 		} else if (n < 0) {
 			perror("Serial read error");
 			break;
@@ -374,43 +391,14 @@ static int run_serial(const char *port_path, int baud, long dpi, int paper, long
 	imagewriter_close();
 	serial_close(port);
 	if (verbose) printf("  [Stopped]\n");
-	else printf("Serial listener stopped.\n");
+	else printf("Serial listener stopped. Page memory peaked at %lu KB.\n", imagewriter_peak_memory());
 	return EXIT_SUCCESS;
 }
 
-/* Apple II preprocessing: same logic as serial loop. Call when replaying session dumps. */
-static void apple2_preprocess_feed(const unsigned char *buf, int n)
-{
-	for (int i = 0; i < n; i++) {
-		unsigned char b = buf[i];
-		if (b == 0x8D || b == 0xFD || b == 0xA9) {
-			imagewriter_loop(0x0D);
-			continue;
-		}
-		if (b == 0xE0) {
-			imagewriter_loop(0x30);
-			continue;
-		}
-		if (b == 0xB2 && i + 1 < n && buf[i + 1] == 0xB9) {
-			for (const char *p = "PRINT "; *p; p++)
-				imagewriter_loop((unsigned char)*p);
-			i++;
-			continue;
-		}
-		if (b == 0xBA) { for (const char *p = "PRINT "; *p; p++) imagewriter_loop((unsigned char)*p); continue; }
-		if (b == 0xAB) { for (const char *p = "GOTO "; *p; p++) imagewriter_loop((unsigned char)*p); continue; }
-		/* ImageWriter Technical Reference: 8th bit always 1 for data, 0 for control */
-		imagewriter_loop((b & 0x80) ? (b & 0x7F) : b);
-	}
-}
-
 /* Run file mode (shared by CLI and interactive) */
 static int run_file_mode(char *files[], int num_files, long dpi, int paper, long banner,
 	const char *output, int multipage, const char *printer, int verbose)
 {
-	setenv("SDL_VIDEODRIVER", "dummy", 1);
-	setenv("SDL_AUDIODRIVER", "dummy", 1);
-
 	if (verbose)
 		imagewriter_set_status_callback(status_callback);
 	if (printer && printer[0])
@@ -457,9 +445,10 @@ static int run_file_mode(char *files[], int num_files, long dpi, int paper, long
 			while ((nr = fread(buf, 1, sizeof(buf), file)) > 0)
 				apple2_preprocess_feed(buf, (int)nr);
 		} else {
-			int c;
-			while ((c = fgetc(file)) != -1)
-				imagewriter_loop(c);
+			unsigned char buf[8192];
+			size_t nr;
+			while ((nr = fread(buf, 1, sizeof(buf), file)) > 0)
+				imagewriter_write(buf, (int)nr);
 		}
 
 		if (!feof(file)) {
@@ -476,6 +465,8 @@ static int run_file_mode(char *files[], int num_files, long dpi, int paper, long
 	if (verbose) printf("  [Complete]\n");
 	else printf("Closing ImageWriter.\n");
 	imagewriter_close();
+	if (!verbose)
+		printf("Page memory peaked at %lu KB.\n", imagewriter_peak_memory());
 	return EXIT_SUCCESS;
 }
 
@@ -679,8 +670,8 @@ static int do_interactive_mode(void)
 static void usage(const char * progname)
 {
 	fprintf(stderr, "Usage:\n");
-	fprintf(stderr, "  File mode:    %s [-d dpi] [-p paper] [-b banner] [-o output] [-m] file [file2 ...]\n", progname);
-	fprintf(stderr, "  Serial mode:  %s [-d dpi] [-p paper] [-b banner] [-o output] [-B baud] [-D] -s <port>\n", progname);
+	fprintf(stderr, "  File mode:    %s [-d dpi] [-p paper] [-b banner] [-o output] [-m] [-O opt=val] file [file2 ...]\n", progname);
+	fprintf(stderr, "  Serial mode:  %s [-d dpi] [-p paper] [-b banner] [-o output] [-B baud] [-D] [-O opt=val] -s <port>\n", progname);
 	fprintf(stderr, "  Interactive:  %s -i\n", progname);
 	fprintf(stderr, "  List ports:   %s -l\n", progname);
 	fprintf(stderr, "\n");
@@ -688,9 +679,31 @@ static void usage(const char * progname)
 	fprintf(stderr, "  -s <port>    Serial port\n");
 	fprintf(stderr, "  -l           List serial ports\n");
 	fprintf(stderr, "  -B <baud>    Baud rate (300,1200,2400,9600,19200)\n");
-	fprintf(stderr, "  -o <type>    Output: bmp, text, ps, colorps, printer\n");
+	fprintf(stderr, "  -o <type>    Output: bmp, text, ps, colorps, png, pdf (zlib builds), printer\n");
 	fprintf(stderr, "  -D           Debug: dump raw serial to session file\n");
 	fprintf(stderr, "  -d, -p, -b, -m  DPI, paper, banner, multipage\n");
+	fprintf(stderr, "  -O <opt=val> Engine option, may be repeated:\n");
+	fprintf(stderr, "               mono=auto|on|off  1 bit black ink, color kept per strip (default auto);\n");
+	fprintf(stderr, "                              on = black only job, continuous feed BMP at 1 bit\n");
+	fprintf(stderr, "               budget=<MB>    Memory for a page, the rest spills to a temporary file\n");
+	fprintf(stderr, "                              (for 720-1440 dpi; default 0 = no limit)\n");
+	fprintf(stderr, "               pool=<MB>      Memory for the pages of all jobs together, spilling\n");
+	fprintf(stderr, "                              strips once it runs out (default 0 = no limit)\n");
+	fprintf(stderr, "               colorps=indexed|rgb  colorps pages as palette indices, or 3 bytes\n");
+	fprintf(stderr, "                              of RGB per pixel for old interpreters (default indexed)\n");
+	fprintf(stderr, "               pslevel=2|3    PostScript 3 compresses images with Flate (builds with\n");
+	fprintf(stderr, "                              zlib only; default 2, run-length)\n");
+	fprintf(stderr, "               deflate=<1-9>  Flate level of PostScript 3, PNG and PDF, 1 = fastest,\n");
+	fprintf(stderr, "                              9 = smallest (default 6)\n");
+	fprintf(stderr, "               threads=<n>    Bands of a PNG page compressed at once (default 0 =\n");
+	fprintf(stderr, "                              one per processor)\n");
+	fprintf(stderr, "               pdf=indexed|gray  PDF pages as palette indices, or gray (default\n");
+	fprintf(stderr, "                              indexed; black and white pages are always Group 4)\n");
+	fprintf(stderr, "               psdata=ascii85|binary  Binary image data for 8-bit spoolers (default ascii85)\n");
+	fprintf(stderr, "               feed=continuous|sheets  Paper runs on without page cuts\n");
+	fprintf(stderr, "                              (bmp, ps, colorps; default sheets)\n");
+	fprintf(stderr, "               reach=<n>      Reverse feed reach on continuous feed, 1/72 inch (default 72)\n");
+	fprintf(stderr, "               preview=on|off Show each page in a window (builds with SDL only)\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Config: %s (loaded when no options given; saved after each run)\n", config_path());
 }
@@ -725,7 +738,7 @@ int main(int argc, char * argv[])
 	}
 
 	int opt;
-	while ((opt = getopt(argc, argv, "d:p:b:mo:s:B:lDi")) != -1) {
+	while ((opt = getopt(argc, argv, "d:p:b:mo:s:B:lDiO:")) != -1) {
 		switch (opt) {
 		case 'd':
 			dpi = strtohu("DPI", optarg);
@@ -771,6 +784,12 @@ int main(int argc, char * argv[])
 		case 'i':
 			interactive = 1;
 			break;
+		case 'O':
+			if (!imagewriter_set_option(optarg)) {
+				fprintf(stderr, "Unknown engine option '%s'\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
 		case '?':
 		default:
 			usage(argv[0]);
@@ -786,6 +805,11 @@ int main(int argc, char * argv[])
 		return EXIT_SUCCESS;
 	}
 
+	if (!imagewriter_has_output(output)) {
+		fprintf(stderr, "Output '%s' needs a build with zlib (make ZLIB=1)\n", output);
+		return EXIT_FAILURE;
+	}
+
 	if (serialPort) {
 		if (optind < argc) {
 			fprintf(stderr, "Serial mode: do not specify input files.\n");
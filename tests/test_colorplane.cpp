@@ -0,0 +1,109 @@
+/*
+ * Packed pages against unpacked ones.
+ *
+ * The same strip of mixed pixels is stored into a page kept at 8 bits and
+ * into one packed to 1 bit with a color plane, and both are read back. The
+ * packed page must give the ribbon colors unchanged, black ink of at least
+ * half intensity as full black and nothing else, whether or not the row
+ * took color itself.
+ */
+#include "imagewriter.h"
+#include "iw_pagebuf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern "C" {
+char* g_imagewriter_fixed_font = (char*)"letgothl.ttf";
+char* g_imagewriter_prop_font = (char*)"letgothl.ttf";
+int iw_scc_write = 0;
+}
+
+class IWPageTest {
+public:
+	static Bitu pitch(Imagewriter* iw) { return iw->page->pitch; }
+	static Bitu width(Imagewriter* iw) { return iw->page->w; }
+	static bool packed(Imagewriter* iw) { return iw->monoPage; }
+	static void write(Imagewriter* iw, Bitu top, Bitu rows, const Bit8u* src) { iw->writePageRows(top, rows, src); }
+	static void read(Imagewriter* iw, Bitu top, Bitu rows, Bit8u* dst) { iw->readPageRows(top, rows, dst); }
+};
+
+// What a packed page makes of an 8-bit pixel
+static Bit8u packedPixel(Bit8u pixel)
+{
+	Bitu ribbons = pixel >> 5;
+	if (ribbons >= 1 && ribbons <= 6)
+		return pixel;
+	return (pixel & 0x1F) >= 16 ? COLOR_BLACK|0x1F : 0;
+}
+
+// Row 0 mixes the ribbon colors with black ink, rows 1 and 2 of the same strip carry black
+// ink only, faint and full; row 3 is in a strip without color
+static const Bitu testRows[] = { 0, 1, 2, 40 };
+#define NUM_TEST_ROWS           (sizeof(testRows)/sizeof(testRows[0]))
+
+static void fillRow(Bit8u* row, Bitu w, Bitu n)
+{
+	memset(row, 0, w);
+	for (Bitu x=0; x<w; x++)
+	{
+		Bitu intensity = (x*7 + n*3) & 0x1F;
+		Bitu kind = (x/3 + n) % 8;
+		if (n == 0 && kind < 6)
+			row[x] = (Bit8u)(((kind+1)<<5) | intensity);
+		else if (kind < 5)
+			row[x] = (Bit8u)(COLOR_BLACK | intensity);
+	}
+}
+
+int main()
+{
+	imagewriter_set_option("mono=off");
+	Imagewriter* plain = new Imagewriter(144, 0, 0, (char*)"bmp", false);
+	imagewriter_set_option("mono=auto");
+	Imagewriter* mono = new Imagewriter(144, 0, 0, (char*)"bmp", false);
+	if (IWPageTest::packed(plain) || !IWPageTest::packed(mono))
+	{
+		printf("FAIL: mono=off and mono=auto pages are not kept as expected\n");
+		return 1;
+	}
+
+	Bitu w = IWPageTest::width(mono);
+	Bitu p = IWPageTest::pitch(mono);
+	Bit8u* src = (Bit8u*)calloc(p, 1);
+	Bit8u* unpacked = (Bit8u*)calloc(p, 1);
+	Bit8u* got = (Bit8u*)calloc(p, 1);
+	for (Bitu i=0; i<NUM_TEST_ROWS; i++)
+	{
+		fillRow(src, w, i);
+		IWPageTest::write(plain, testRows[i], 1, src);
+		IWPageTest::write(mono, testRows[i], 1, src);
+	}
+
+	int failures = 0;
+	for (Bitu i=0; i<NUM_TEST_ROWS; i++)
+	{
+		IWPageTest::read(plain, testRows[i], 1, unpacked);
+		IWPageTest::read(mono, testRows[i], 1, got);
+		for (Bitu x=0; x<w; x++)
+		{
+			Bit8u expect = packedPixel(unpacked[x]);
+			if (got[x] != expect && failures++ < 10)
+				printf("FAIL: row %u pixel %u is %02X, the unpacked page gives %02X -> %02X\n",
+					(unsigned)testRows[i], (unsigned)x, got[x], unpacked[x], expect);
+		}
+	}
+
+	free(src);
+	free(unpacked);
+	free(got);
+	delete mono;
+	delete plain;
+	if (failures > 0)
+	{
+		printf("test_colorplane: %d pixels differ\n", failures);
+		return 1;
+	}
+	printf("test_colorplane: ok\n");
+	return 0;
+}
@@ -0,0 +1,115 @@
+/*
+ * Two pages against one pool of row blocks.
+ *
+ * Leases past the pool budget are refused, a block one page gives back goes
+ * to the other, a forced block has a page spill rows to stay within the
+ * budget, blocks forced over it once no page can and spares past
+ * IW_POOL_SPARE go back to the system, and each page counts what it holds
+ * and its peak.
+ */
+#include "iw_pagebuf.h"
+#include <stdio.h>
+
+#define BLOCK                   (64*1024)
+#define HELD(n)                 ((Bit64u)(n)*(BLOCK + IW_PAGE_ALIGN))
+
+static int failures = 0;
+
+// Rows page b can give back when the pool asks, as a printer spills its strips
+static Bit8u* spillable[2];
+static Bitu numSpillable = 0;
+
+static bool giveBack(void* owner)
+{
+	if (numSpillable == 0)
+		return false;
+	((IWPageBuffer*)owner)->freeRows(spillable[--numSpillable]);
+	return true;
+}
+
+static void check(bool ok, const char* what)
+{
+	if (!ok)
+	{
+		printf("FAIL: %s\n", what);
+		failures++;
+	}
+}
+
+int main()
+{
+	IWPageBuffer* a = new IWPageBuffer(640, 480);
+	IWPageBuffer* b = new IWPageBuffer(640, 480);
+
+	// A budget of four blocks: page a takes three, b the last one, and no more
+	IWPageBuffer::setPoolBudget(HELD(4));
+	Bit8u* rowsA[4];
+	for (Bitu i=0; i<3; i++)
+		rowsA[i] = a->leaseRows(BLOCK);
+	Bit8u* rowsB[2];
+	rowsB[0] = b->leaseRows(BLOCK);
+	rowsB[1] = b->leaseRows(BLOCK);
+	check(rowsA[0] != NULL && rowsA[1] != NULL && rowsA[2] != NULL && rowsB[0] != NULL, "leases within the budget");
+	check(rowsB[1] == NULL, "a lease over the budget is refused");
+	check(a->used == 3*BLOCK && a->peak == 3*BLOCK, "page a holds three blocks");
+	check(b->used == BLOCK && b->peak == BLOCK, "page b holds one block");
+	check(IWPageBuffer::poolHeld() == HELD(4), "the pool holds four blocks");
+
+	// What a gives back goes to b
+	a->freeRows(rowsA[2]);
+	rowsB[1] = b->leaseRows(BLOCK);
+	check(rowsB[1] == rowsA[2], "a block given back is leased again");
+	check(a->used == 2*BLOCK && a->peak == 3*BLOCK, "page a keeps its peak");
+	check(b->used == 2*BLOCK && b->peak == 2*BLOCK, "page b holds two blocks");
+	check(IWPageBuffer::poolHeld() == HELD(4), "reuse does not grow the pool");
+
+	// A forced block has b give a block back first
+	b->setReclaim(giveBack, b);
+	spillable[numSpillable++] = rowsB[1];
+	rowsA[2] = a->allocRows(BLOCK);
+	check(rowsA[2] != NULL && numSpillable == 0, "a forced block has a page give rows back");
+	check(b->used == BLOCK, "page b gave one block back");
+	check(IWPageBuffer::poolHeld() == HELD(4), "the forced block stays within the budget");
+
+	// With nothing left to give it goes over the budget and is not kept once given back
+	rowsA[3] = a->allocRows(BLOCK);
+	check(rowsA[3] != NULL && a->peak == 4*BLOCK, "forced blocks are granted over the budget");
+	check(IWPageBuffer::poolHeld() == HELD(5), "the pool holds the forced block");
+	a->freeRows(rowsA[3]);
+	check(IWPageBuffer::poolHeld() == HELD(4), "a block over the budget is released");
+	b->setReclaim(NULL, NULL);
+	rowsB[1] = b->leaseRows(BLOCK);
+	check(rowsB[1] == NULL, "the pool is full again");
+	a->freeRows(rowsA[2]);
+	rowsB[1] = b->leaseRows(BLOCK);
+
+	// Without a budget the spares are trimmed to IW_POOL_SPARE
+	IWPageBuffer::setPoolBudget(0);
+	const Bitu many = IW_POOL_SPARE/BLOCK + 8;
+	Bit8u** rows = new Bit8u*[many];
+	for (Bitu i=0; i<many; i++)
+		rows[i] = b->leaseRows(BLOCK);
+	check(b->used == (2 + many)*BLOCK && b->peak == b->used, "page b counts the leases");
+	for (Bitu i=0; i<many; i++)
+		b->freeRows(rows[i]);
+	delete[] rows;
+	check(b->used == 2*BLOCK && b->peak == (2 + many)*BLOCK, "page b is back to two blocks");
+	check(IWPageBuffer::poolHeld() <= HELD(4) + IW_POOL_SPARE, "the spares are trimmed");
+
+	a->freeRows(rowsA[0]);
+	a->freeRows(rowsA[1]);
+	b->freeRows(rowsB[0]);
+	b->freeRows(rowsB[1]);
+	check(a->used == 0 && b->used == 0, "both pages gave everything back");
+	delete a;
+	delete b;
+	check(IWPageBuffer::poolHeld() == 0, "the last page out empties the pool");
+
+	if (failures > 0)
+	{
+		printf("test_pool: %d checks failed\n", failures);
+		return 1;
+	}
+	printf("test_pool: ok\n");
+	return 0;
+}
@@ -0,0 +1,314 @@
+/*
+ * PostScript image data round trips.
+ *
+ * Rows are put through the encoder into a temporary file and decoded back
+ * the way the interpreter would: ASCII85 (with its z groups and the short
+ * last group), then RunLengthDecode or, in builds with zlib, FlateDecode.
+ * The rows cover runs and literals across the 128 byte limit of a run-length
+ * record, inverted rows and repeats; the stored Flate fallback is forced to
+ * check its blocks and checksum.
+ */
+#include "iw_psencode.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+class IWEncoderTest {
+public:
+#ifdef HAVE_ZLIB
+	// What the encoder does when deflateInit() fails
+	static void forceStored(IWPSEncoder* e) { deflateEnd(&e->zs); e->beginStored(); }
+#endif
+};
+
+static int failures = 0;
+
+static void check(bool ok, const char* what, const char* mode)
+{
+	if (!ok)
+	{
+		printf("FAIL: %s (%s)\n", what, mode);
+		failures++;
+	}
+}
+
+// The rows of the test image, one after the other, and the same inverted where asked
+struct TestData {
+	Bit8u* bytes;
+	Bitu len;
+};
+
+static void append(TestData* t, const Bit8u* data, Bitu len, Bit8u invert)
+{
+	for (Bitu i=0; i<len; i++)
+		t->bytes[t->len++] = data[i] ^ invert;
+}
+
+// Puts the test rows through e and collects what they should decode to in expect. extra
+// literal bytes at the end shift the length of the encoded data
+static void putRows(IWPSEncoder* e, TestData* expect, Bitu extra)
+{
+	Bit8u row[1000];
+	Bitu n = 0;
+
+	// A run of 300 (over two records), literals of 200 (over two records), runs of two and
+	// three, a run that starts within eight bytes of the end
+	memset(&row[n], 0x11, 300);
+	n += 300;
+	for (Bitu i=0; i<200; i++)
+		row[n++] = (Bit8u)(i*7 + 1);
+	row[n++] = 5; row[n++] = 5; row[n++] = 6;
+	row[n++] = 7; row[n++] = 7; row[n++] = 7; row[n++] = 8;
+	for (Bitu i=0; i<129; i++)
+		row[n++] = (Bit8u)(i & 1 ? 0x40 : 0x41);
+	memset(&row[n], 0, 13);
+	n += 13;
+	row[n++] = 9; row[n++] = 9; row[n++] = 9;
+	e->putRow(row, n);
+	append(expect, row, n, 0);
+
+	// The same inverted, as the gray pages are
+	e->putRow(row, n, 0xFF);
+	append(expect, row, n, 0xFF);
+
+	// Blank rows: runs over the record limit, a remainder too short for a run, and one
+	// longer than a stored block
+	Bitu lens[] = { 1000, 130, 2, 1, 5000 };
+	for (Bitu i=0; i<sizeof(lens)/sizeof(lens[0]); i++)
+	{
+		e->putRepeat(0xFF, lens[i]);
+		memset(&expect->bytes[expect->len], 0xFF, lens[i]);
+		expect->len += lens[i];
+	}
+
+	// Zero bytes in whole ASCII85 groups, and a total length that leaves a short last group
+	memset(row, 0, 64);
+	e->putRow(row, 64);
+	append(expect, row, 64, 0);
+	for (Bitu i=0; i<7; i++)
+		row[i] = (Bit8u)(0xF0 + i);
+	e->putRow(row, 7);
+	append(expect, row, 7, 0);
+
+	for (Bitu i=0; i<extra; i++)
+		row[i] = (Bit8u)(0x21 + i*3);
+	if (extra > 0)
+	{
+		e->putRow(row, extra);
+		append(expect, row, extra, 0);
+	}
+}
+
+static Bit8u* readFile(FILE* f, Bitu* len)
+{
+	long size = ftell(f);
+	Bit8u* data = (Bit8u*)malloc(size + 1);
+	rewind(f);
+	*len = fread(data, 1, size, f);
+	return data;
+}
+
+// ASCII85 text up to ~> into bytes. Returns the decoded length, or -1 if it is malformed
+static long decodeASCII85(const Bit8u* text, Bitu len, Bit8u* out, bool* sawZ, bool* lineOk)
+{
+	long n = 0;
+	Bit32u group = 0;
+	int count = 0;
+	Bitu column = 0;
+	*sawZ = false;
+	*lineOk = true;
+	for (Bitu i=0; i<len; i++)
+	{
+		Bit8u c = text[i];
+		if (c == '\n')
+		{
+			column = 0;
+			continue;
+		}
+		if (column++ == 0 && c == '%')
+			*lineOk = false;
+		if (column > IW_PS_COLUMNS + 1)
+			*lineOk = false;
+		if (c == ' ')
+			continue;
+		if (c == '~')
+		{
+			if (i+1 >= len || text[i+1] != '>' || count == 1)
+				return -1;
+			if (count > 0)
+			{
+				// A short group of count characters stands for count-1 bytes, padded with u
+				for (int k=count; k<5; k++)
+					group = group*85 + 84;
+				for (int k=0; k<count-1; k++)
+					out[n++] = (Bit8u)(group >> (24 - 8*k));
+			}
+			return n;
+		}
+		if (c == 'z' && count == 0)
+		{
+			*sawZ = true;
+			memset(&out[n], 0, 4);
+			n += 4;
+			continue;
+		}
+		if (c < '!' || c > 'u')
+			return -1;
+		group = group*85 + (c - '!');
+		if (++count == 5)
+		{
+			for (int k=0; k<4; k++)
+				out[n++] = (Bit8u)(group >> (24 - 8*k));
+			group = 0;
+			count = 0;
+		}
+	}
+	return -1;
+}
+
+// Run-length records up to EOD. Returns the decoded length, or -1 if it is malformed
+static long decodeRunLength(const Bit8u* data, Bitu len, Bit8u* out)
+{
+	long n = 0;
+	Bitu i = 0;
+	while (i < len)
+	{
+		Bit8u c = data[i++];
+		if (c == 128)
+			return n;
+		if (c < 128)
+		{
+			if (i + c + 1 > len)
+				return -1;
+			memcpy(&out[n], &data[i], c + 1);
+			n += c + 1;
+			i += c + 1;
+		}
+		else
+		{
+			if (i >= len)
+				return -1;
+			memset(&out[n], data[i++], 257 - c);
+			n += 257 - c;
+		}
+	}
+	return -1;
+}
+
+#ifdef HAVE_ZLIB
+static long decodeFlate(const Bit8u* data, Bitu len, Bit8u* out, Bitu outSize)
+{
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit(&zs) != Z_OK)
+		return -1;
+	zs.next_in = (Bytef*)data;
+	zs.avail_in = len;
+	zs.next_out = out;
+	zs.avail_out = outSize;
+	int ret = inflate(&zs, Z_FINISH);
+	long n = (long)(outSize - zs.avail_out);
+	inflateEnd(&zs);
+	return ret == Z_STREAM_END ? n : -1;
+}
+#endif
+
+// Encodes the test rows one way and checks they come back
+static void roundTrip(int deflate, bool binary, bool stored, Bitu extra, const char* mode)
+{
+	FILE* f = tmpfile();
+	if (f == NULL)
+	{
+		check(false, "no temporary file", mode);
+		return;
+	}
+	TestData expect;
+	expect.bytes = (Bit8u*)malloc(16384);
+	expect.len = 0;
+
+	IWPSEncoder* e = new IWPSEncoder(f, deflate, binary);
+#ifdef HAVE_ZLIB
+	if (stored)
+		IWEncoderTest::forceStored(e);
+#else
+	(void)stored;
+#endif
+	putRows(e, &expect, extra);
+	e->finish();
+	delete e;
+
+	Bitu fileLen;
+	Bit8u* file = readFile(f, &fileLen);
+	fclose(f);
+
+	// The data stream under ASCII85
+	Bit8u* data = (Bit8u*)malloc(fileLen + 16384);
+	Bitu dataLen = fileLen;
+	if (binary)
+	{
+		check(fileLen > 0 && file[fileLen-1] == '\n', "binary data ends with a newline", mode);
+		memcpy(data, file, fileLen);
+	}
+	else
+	{
+		bool sawZ, lineOk;
+		long n = decodeASCII85(file, fileLen, data, &sawZ, &lineOk);
+		check(n >= 0, "ASCII85 decodes up to ~>", mode);
+		check(lineOk, "ASCII85 lines are short and never start with %", mode);
+		check(sawZ || !stored, "zero groups are written as z", mode);
+		dataLen = n < 0 ? 0 : (Bitu)n;
+	}
+
+	Bit8u* decoded = (Bit8u*)malloc(16384);
+	long n = -1;
+	if (deflate == 0)
+		n = decodeRunLength(data, dataLen, decoded);
+#ifdef HAVE_ZLIB
+	else
+	{
+		n = decodeFlate(data, dataLen, decoded, 16384);
+		if (stored)
+			check(dataLen > expect.len, "stored blocks are not compressed", mode);
+		else
+			check(dataLen < expect.len, "Flate data is compressed", mode);
+	}
+#endif
+	check(n == (long)expect.len, "the decoded length matches", mode);
+	check(n == (long)expect.len && memcmp(decoded, expect.bytes, expect.len) == 0, "the decoded bytes match", mode);
+
+	free(decoded);
+	free(data);
+	free(file);
+	free(expect.bytes);
+}
+
+int main()
+{
+	// Each extra byte lengthens the run-length data by one: the last ASCII85 group is one
+	// to four bytes long
+	char mode[64];
+	for (Bitu extra=1; extra<=4; extra++)
+	{
+		snprintf(mode, sizeof(mode), "run-length, ASCII85, %u extra bytes", (unsigned)extra);
+		roundTrip(0, false, false, extra, mode);
+	}
+	roundTrip(0, true, false, 0, "run-length, binary");
+#ifdef HAVE_ZLIB
+	roundTrip(6, false, false, 0, "Flate, ASCII85");
+	roundTrip(9, true, false, 0, "Flate, binary");
+	for (Bitu extra=1; extra<=4; extra++)
+	{
+		snprintf(mode, sizeof(mode), "stored Flate, ASCII85, %u extra bytes", (unsigned)extra);
+		roundTrip(6, false, true, extra, mode);
+	}
+	roundTrip(6, true, true, 0, "stored Flate, binary");
+#endif
+
+	if (failures > 0)
+	{
+		printf("test_psencode: %d checks failed\n", failures);
+		return 1;
+	}
+	printf("test_psencode: ok\n");
+	return 0;
+}